@@ -0,0 +1,109 @@
+/*
+* Copyright(c) 2016 Zonciu Liang.All rights reserved.
+* Use of this source code is governed by a BSD-style license that can be
+* found in the LICENSE file.
+*
+* Author:  Zonciu Liang
+* Contract: zonciu@zonciu.com
+* Description: lock contention benchmark, throughput and fairness by thread count
+*
+* Build: g++ -std=c++11 -O2 -I../include lock_bench.cpp -o lock_bench -pthread
+* Usage: lock_bench [thread counts...], default 2 4 8 16 32 64
+*/
+#include "zonciu/lock.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+namespace
+{
+using namespace std::chrono;
+const milliseconds kRunTime(200);
+// per-thread counter on its own line, only the lock and the guarded data are shared
+struct Counter
+{
+    Counter() : value(0) {}
+    std::uint64_t value;
+    char pad[64 - sizeof(std::uint64_t)];
+};
+// Every thread takes the lock for a short critical section (a few shared
+// writes) then does a little private work, until the run time is up.
+// Prints total acquisitions per second and max/min per-thread share.
+template<class Lock>
+void Run(const char* name, std::size_t threads)
+{
+    std::unique_ptr<Lock> lock(new Lock);
+    std::uint64_t shared[8] = {};
+    std::vector<Counter> counters(threads);
+    std::atomic<bool> start(false);
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> group;
+    for (std::size_t t = 0; t < threads; ++t)
+    {
+        group.emplace_back([&, t]()
+        {
+            while (!start.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            std::uint64_t local = t;
+            std::uint64_t count = 0;
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                {
+                    std::lock_guard<Lock> guard(*lock);
+                    for (auto& it : shared)
+                        it += local;
+                }
+                for (int i = 0; i < 32; ++i)
+                    local = local * 6364136223846793005ULL + 1442695040888963407ULL;
+                ++count;
+            }
+            counters[t].value = count;
+        });
+    }
+    auto begin = steady_clock::now();
+    start.store(true, std::memory_order_release);
+    std::this_thread::sleep_for(kRunTime);
+    stop.store(true, std::memory_order_relaxed);
+    for (auto& it : group)
+        it.join();
+    double seconds = duration_cast<duration<double>>(steady_clock::now() - begin).count();
+    std::uint64_t total = 0;
+    std::uint64_t low = ~0ULL;
+    std::uint64_t high = 0;
+    for (auto& it : counters)
+    {
+        total += it.value;
+        low = it.value < low ? it.value : low;
+        high = it.value > high ? it.value : high;
+    }
+    std::printf("%-10s %8zu %14.0f %10.1f\n", name, threads, total / seconds,
+        low ? static_cast<double>(high) / low : 0.0);
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+    std::vector<std::size_t> counts;
+    for (int i = 1; i < argc; ++i)
+        counts.push_back(static_cast<std::size_t>(std::strtoull(argv[i], nullptr, 10)));
+    if (counts.empty())
+        counts = { 2, 4, 8, 16, 32, 64 };
+    std::printf("hardware threads: %u\n", std::thread::hardware_concurrency());
+    std::printf("%-10s %8s %14s %10s\n", "lock", "threads", "acquire/s", "max/min");
+    for (auto threads : counts)
+    {
+        Run<std::mutex>("mutex", threads);
+        Run<zonciu::SpinLock>("spin", threads);
+        Run<zonciu::TtasSpinLock>("ttas", threads);
+        Run<zonciu::BackoffSpinLock>("backoff", threads);
+        Run<zonciu::TicketSpinLock>("ticket", threads);
+        Run<zonciu::McsLock>("mcs", threads);
+        Run<zonciu::ClhLock>("clh", threads);
+    }
+    return 0;
+}
@@ -0,0 +1,178 @@
+/*
+* Copyright(c) 2016 Zonciu Liang.All rights reserved.
+* Use of this source code is governed by a BSD-style license that can be
+* found in the LICENSE file.
+*
+* Author:  Zonciu Liang
+* Contract: zonciu@zonciu.com
+* Description: timer benchmark, throughput on a VirtualClock, firing lateness
+*              and the inline-execution latency of short timers
+*
+* Build: g++ -std=c++11 -O2 -I../include timer_bench.cpp -o timer_bench -pthread
+* Usage: timer_bench [timer counts...], default 1000 100000 1000000
+*/
+#include "zonciu/histogram.hpp"
+#include "zonciu/timer.hpp"
+#include "zonciu/wheel_timer.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+namespace
+{
+using namespace std::chrono;
+typedef steady_clock::time_point TimePoint;
+// deterministic delays, every run schedules the same timers
+class Random
+{
+public:
+    explicit Random(std::uint64_t seed) : _state(seed) {}
+    std::uint64_t Next()
+    {
+        // xorshift64
+        _state ^= _state << 13;
+        _state ^= _state >> 7;
+        _state ^= _state << 17;
+        return _state;
+    }
+private:
+    std::uint64_t _state;
+};
+double Rate(std::size_t count, TimePoint begin, TimePoint end)
+{
+    double seconds = duration_cast<duration<double>>(end - begin).count();
+    return seconds > 0 ? count / seconds : 0.0;
+}
+// Insert, cancel half, fire the rest. The clock is virtual, nothing sleeps,
+// so the numbers are pure bookkeeping cost including the worker hop.
+void Throughput(std::size_t count)
+{
+    zonciu::VirtualClock clock;
+    zonciu::MinHeapTimer timer(1, zonciu::MinHeapTimer::Dispatch::any, &clock);
+    std::atomic<std::size_t> fired(0);
+    std::vector<zonciu::MinHeapTimer::TimerId> ids(count);
+    Random random(count);
+    auto begin = steady_clock::now();
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        microseconds delay(1 + random.Next() % 1000000);
+        ids[i] = timer.SetTimeout(delay, [&fired]() { fired.fetch_add(1, std::memory_order_relaxed); });
+    }
+    timer.Sync();
+    auto inserted = steady_clock::now();
+    std::size_t cancelled = 0;
+    for (std::size_t i = 0; i < count; i += 2)
+        cancelled += timer.Remove(ids[i]) ? 1 : 0;
+    timer.Sync();
+    auto removed = steady_clock::now();
+    clock.Advance(seconds(2));
+    timer.Sync();
+    auto done = steady_clock::now();
+    std::size_t expect = count - cancelled;
+    std::printf("%-10zu %12.0f %12.0f %12.0f%s\n", count, Rate(count, begin, inserted),
+        Rate(cancelled, inserted, removed), Rate(expect, removed, done),
+        fired.load() == expect ? "" : "  (fired count mismatch)");
+}
+void Report(const char* name, std::size_t count, const zonciu::Histogram& lateness)
+{
+    zonciu::Histogram::Snapshot snap = lateness.Snap();
+    std::printf("%-14s %-10zu %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, count,
+        snap.Percentile(50) / 1000.0, snap.Percentile(90) / 1000.0, snap.Percentile(99) / 1000.0,
+        snap.Percentile(99.9) / 1000.0, snap.max / 1000.0);
+}
+// Real clock: timers due over [100ms, 100ms + window), every handler
+// records how late it ran against the deadline taken at insert time.
+template<class Timer>
+void Lateness(const char* name, Timer& timer, std::size_t count)
+{
+    zonciu::Histogram lateness;
+    std::atomic<std::size_t> fired(0);
+    // at most 200k timers per second of window, so the load itself does not
+    // saturate one core and lateness stays a property of the engine
+    std::uint64_t window = count * 5 > 1000000 ? count * 5 : 1000000;
+    Random random(count);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        microseconds delay(100000 + random.Next() % window);
+        TimePoint due = steady_clock::now() + delay;
+        timer.SetTimeout(delay, [due, &lateness, &fired]()
+        {
+            auto late = steady_clock::now() - due;
+            lateness.Record(late.count() > 0 ? static_cast<std::uint64_t>(duration_cast<nanoseconds>(late).count()) : 0);
+            fired.fetch_add(1, std::memory_order_relaxed);
+        });
+    }
+    auto deadline = steady_clock::now() + microseconds(window) + seconds(10);
+    while (fired.load() < count && steady_clock::now() < deadline)
+        std::this_thread::sleep_for(milliseconds(10));
+    Report(name, count, lateness);
+}
+// Sub-100us timers one at a time, nothing else queued: what is left is the
+// observer wakeup plus, without SetInlineBudget, the hop to the worker.
+void ShortTimers(const char* name, zonciu::MinHeapTimer& timer, std::size_t count)
+{
+    zonciu::Histogram lateness;
+    Random random(count);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        std::atomic<bool> fired(false);
+        microseconds delay(20 + random.Next() % 80);
+        TimePoint due = steady_clock::now() + delay;
+        timer.SetTimeout(delay, [due, &lateness, &fired]()
+        {
+            auto late = steady_clock::now() - due;
+            lateness.Record(late.count() > 0 ? static_cast<std::uint64_t>(duration_cast<nanoseconds>(late).count()) : 0);
+            fired.store(true, std::memory_order_release);
+        });
+        while (!fired.load(std::memory_order_acquire))
+            std::this_thread::yield();
+    }
+    Report(name, count, lateness);
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+    std::vector<std::size_t> counts;
+    for (int i = 1; i < argc; ++i)
+        counts.push_back(static_cast<std::size_t>(std::strtoull(argv[i], nullptr, 10)));
+    if (counts.empty())
+        counts = { 1000, 100000, 1000000 };
+    std::printf("MinHeapTimer throughput, VirtualClock (ops/s)\n");
+    std::printf("%-10s %12s %12s %12s\n", "timers", "insert", "cancel", "fire");
+    for (auto count : counts)
+        Throughput(count);
+    std::printf("\nFiring lateness, steady_clock (us)\n");
+    std::printf("%-14s %-10s %9s %9s %9s %9s %9s\n", "engine", "timers", "p50", "p90", "p99", "p99.9", "max");
+    for (auto count : counts)
+    {
+        {
+            zonciu::MinHeapTimer timer;
+            Lateness("heap", timer, count);
+        }
+        {
+            zonciu::MinHeapTimer timer;
+            timer.SetInlineBudget(microseconds(50));
+            Lateness("heap inline", timer, count);
+        }
+        {
+            zonciu::WheelTimer timer;
+            Lateness("wheel 1ms", timer, count);
+        }
+    }
+    std::printf("\nSub-100us timers, one in flight (us)\n");
+    std::printf("%-14s %-10s %9s %9s %9s %9s %9s\n", "engine", "timers", "p50", "p90", "p99", "p99.9", "max");
+    {
+        zonciu::MinHeapTimer timer;
+        ShortTimers("heap worker", timer, 10000);
+    }
+    {
+        zonciu::MinHeapTimer timer;
+        timer.SetInlineBudget(microseconds(50));
+        ShortTimers("heap inline", timer, 10000);
+    }
+    return 0;
+}
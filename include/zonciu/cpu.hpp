@@ -0,0 +1,318 @@
+/*
+* Copyright(c) 2016 Zonciu Liang.All rights reserved.
+* Use of this source code is governed by a BSD-style license that can be
+* found in the LICENSE file.
+*
+* Author:  Zonciu Liang
+* Contract: zonciu@zonciu.com
+* Description: cpu topology, thread affinity, thread names and numa hints
+*/
+#ifndef ZONCIU_CPU_HPP
+#define ZONCIU_CPU_HPP
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(__APPLE__)
+#include <pthread.h>
+#endif
+namespace zonciu
+{
+//How ThreadGroup::CreateWorkers spreads threads
+//| none       - no affinity
+//| per_cpu    - one logical cpu each
+//| per_core   - one physical core each (all its hyper-threads), sockets interleaved
+//| per_socket - one socket each
+enum class Placement
+{
+    none,
+    per_cpu,
+    per_core,
+    per_socket
+};
+struct ThreadOptions
+{
+    ThreadOptions() {}
+    ThreadOptions(std::vector<int> _cpus, std::string _name = std::string())
+        :
+        cpus(std::move(_cpus)), name(std::move(_name))
+    {}
+    // logical cpus the thread may run on, empty = any
+    std::vector<int> cpus;
+    // at most 15 characters are kept on Linux
+    std::string name;
+};
+/*
+ * Cpu layout read from Linux sysfs (/sys/devices/system/cpu, node).
+ * Other platforms see one socket and one node with hardware_concurrency cpus.
+ * api:
+ * | Get        - topology of this machine, read once
+ * | Layout     - cpu sets for [count] threads by Placement
+ * | NodeOfCpu  - numa node of a logical cpu
+*/
+class CpuTopology
+{
+public:
+    struct Cpu
+    {
+        int id;
+        int core;   // physical core id, unique within a socket
+        int socket; // physical package id
+        int node;   // numa node
+    };
+    static const CpuTopology& Get()
+    {
+        static const CpuTopology topology;
+        return topology;
+    }
+    const std::vector<Cpu>& Cpus() const { return _cpus; }
+    int SocketCount() const { return _sockets; }
+    int NodeCount() const { return _nodes; }
+    int NodeOfCpu(int cpu) const
+    {
+        for (auto& it : _cpus)
+        {
+            if (it.id == cpu)
+                return it.node;
+        }
+        return 0;
+    }
+    //Cpu set of every thread, threads past the number of units wrap around
+    std::vector<std::vector<int>> Layout(Placement placement, std::size_t count) const
+    {
+        std::vector<std::vector<int>> units;
+        switch (placement)
+        {
+        case Placement::per_cpu:
+            for (auto& cpu : _cpus)
+                units.push_back(std::vector<int>(1, cpu.id));
+            break;
+        case Placement::per_core:
+        {
+            // (socket, core) -> cpus, then take one core from each socket in turn
+            std::map<std::pair<int, int>, std::vector<int>> cores;
+            for (auto& cpu : _cpus)
+                cores[std::make_pair(cpu.socket, cpu.core)].push_back(cpu.id);
+            std::map<int, std::vector<std::vector<int>>> by_socket;
+            for (auto& core : cores)
+                by_socket[core.first.first].push_back(core.second);
+            for (std::size_t round = 0;; ++round)
+            {
+                bool any = false;
+                for (auto& socket : by_socket)
+                {
+                    if (round < socket.second.size())
+                    {
+                        units.push_back(socket.second[round]);
+                        any = true;
+                    }
+                }
+                if (!any)
+                    break;
+            }
+            break;
+        }
+        case Placement::per_socket:
+        {
+            std::map<int, std::vector<int>> sockets;
+            for (auto& cpu : _cpus)
+                sockets[cpu.socket].push_back(cpu.id);
+            for (auto& socket : sockets)
+                units.push_back(socket.second);
+            break;
+        }
+        case Placement::none:
+        default:
+            break;
+        }
+        std::vector<std::vector<int>> ret(count);
+        if (!units.empty())
+        {
+            for (std::size_t i = 0; i < count; ++i)
+                ret[i] = units[i % units.size()];
+        }
+        return ret;
+    }
+    //Parse a sysfs cpu list such as "0-3,8,10-11"
+    static std::vector<int> ParseList(const std::string& text)
+    {
+        std::vector<int> ret;
+        std::stringstream stream(text);
+        std::string range;
+        while (std::getline(stream, range, ','))
+        {
+            if (range.empty() || range[0] < '0' || range[0] > '9')
+                continue;
+            std::size_t dash = range.find('-');
+            int first = std::atoi(range.c_str());
+            int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+            for (int i = first; i <= last; ++i)
+                ret.push_back(i);
+        }
+        return ret;
+    }
+private:
+    CpuTopology() : _sockets(1), _nodes(1)
+    {
+#if defined(__linux__)
+        std::vector<int> online = ParseList(ReadLine("/sys/devices/system/cpu/online"));
+        std::map<int, int> node_of;
+        std::vector<int> nodes = ParseList(ReadLine("/sys/devices/system/node/online"));
+        for (int node : nodes)
+        {
+            for (int cpu : ParseList(ReadLine("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist")))
+                node_of[cpu] = node;
+        }
+        for (int id : online)
+        {
+            std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(id) + "/topology/";
+            std::string core = ReadLine(base + "core_id");
+            std::string socket = ReadLine(base + "physical_package_id");
+            Cpu cpu;
+            cpu.id = id;
+            cpu.core = core.empty() ? id : std::atoi(core.c_str());
+            cpu.socket = socket.empty() ? 0 : std::atoi(socket.c_str());
+            cpu.node = node_of.count(id) ? node_of[id] : 0;
+            _cpus.push_back(cpu);
+        }
+#endif
+        if (_cpus.empty())
+        {
+            unsigned int count = std::thread::hardware_concurrency();
+            for (unsigned int i = 0; i < (count ? count : 1); ++i)
+            {
+                Cpu cpu = { static_cast<int>(i), static_cast<int>(i), 0, 0 };
+                _cpus.push_back(cpu);
+            }
+        }
+        int max_socket = 0;
+        int max_node = 0;
+        for (auto& cpu : _cpus)
+        {
+            max_socket = std::max(max_socket, cpu.socket);
+            max_node = std::max(max_node, cpu.node);
+        }
+        _sockets = max_socket + 1;
+        _nodes = max_node + 1;
+    }
+    static std::string ReadLine(const std::string& path)
+    {
+        std::ifstream file(path.c_str());
+        std::string line;
+        std::getline(file, line);
+        return line;
+    }
+    std::vector<Cpu> _cpus;
+    int _sockets;
+    int _nodes;
+};
+namespace cpu
+{
+//Pin the calling thread to [cpus]
+//Return false if unsupported or rejected
+inline bool SetAffinity(const std::vector<int>& cpus)
+{
+#if defined(__linux__)
+    if (cpus.empty())
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+    {
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+//Name the calling thread, shows up in top/gdb/perf
+inline bool SetName(const std::string& name)
+{
+#if defined(__linux__)
+    return pthread_setname_np(pthread_self(), name.substr(0, 15).c_str()) == 0;
+#elif defined(__APPLE__)
+    return pthread_setname_np(name.c_str()) == 0;
+#else
+    (void)name;
+    return false;
+#endif
+}
+//Logical cpu the calling thread runs on now, -1 if unknown
+inline int Current()
+{
+#if defined(__linux__)
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
+//Kernel thread id of the calling thread (/proc/self/task/<id>), 0 if unknown
+inline long ThreadId()
+{
+#if defined(__linux__) && defined(SYS_gettid)
+    return static_cast<long>(syscall(SYS_gettid));
+#else
+    return 0;
+#endif
+}
+//Apply ThreadOptions to the calling thread
+inline void Apply(const ThreadOptions& options)
+{
+    if (!options.cpus.empty())
+        SetAffinity(options.cpus);
+    if (!options.name.empty())
+        SetName(options.name);
+}
+//Allocate [bytes] of page-aligned memory preferring numa [node], node < 0 =
+//the node of the calling thread (first touch). Free with NumaFree.
+//Only a hint, the kernel falls back to other nodes when [node] is full.
+inline void* NumaAlloc(std::size_t bytes, int node = -1)
+{
+#if defined(__linux__)
+    void* ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+        return nullptr;
+#if defined(SYS_mbind)
+    if (node >= 0 && node < static_cast<int>(sizeof(unsigned long) * 8))
+    {
+        const int kMpolPreferred = 1;
+        unsigned long mask = 1UL << node;
+        // maxnode is one past the highest bit the kernel reads
+        syscall(SYS_mbind, ptr, bytes, kMpolPreferred, &mask, sizeof(mask) * 8 + 1, 0);
+    }
+#endif
+    return ptr;
+#else
+    (void)node;
+    return std::malloc(bytes);
+#endif
+}
+inline void NumaFree(void* ptr, std::size_t bytes)
+{
+    if (!ptr)
+        return;
+#if defined(__linux__)
+    munmap(ptr, bytes);
+#else
+    (void)bytes;
+    std::free(ptr);
+#endif
+}
+} // namespace cpu
+} // namespace zonciu
+#endif // ZONCIU_CPU_HPP
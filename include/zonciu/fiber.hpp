@@ -0,0 +1,651 @@
+/*
+* Copyright(c) 2016 Zonciu Liang.All rights reserved.
+* Use of this source code is governed by a BSD-style license that can be
+* found in the LICENSE file.
+*
+* Author:  Zonciu Liang
+* Contract: zonciu@zonciu.com
+* Description: stackful fibers, M:N scheduler and fiber-aware primitives
+*/
+#ifndef ZONCIU_FIBER_HPP
+#define ZONCIU_FIBER_HPP
+#include "zonciu/inplace_function.hpp"
+#include "zonciu/lock.hpp"
+#include "zonciu/semaphor.hpp"
+#include "zonciu/thread.hpp"
+#include "zonciu/thread_pool.hpp"
+#include "zonciu/timer.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <vector>
+#if !defined(__unix__) && !defined(__APPLE__)
+#error "zonciu/fiber.hpp needs a POSIX system"
+#endif
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(__x86_64__) && defined(__linux__)
+#define ZONCIU_FIBER_ASM 1
+#else
+#include <ucontext.h>
+#endif
+#if defined(__GNUC__) || defined(__clang__)
+#define ZONCIU_NOINLINE __attribute__((noinline))
+#else
+#define ZONCIU_NOINLINE
+#endif
+
+#if defined(ZONCIU_FIBER_ASM)
+// Context switch for x86-64 System V, callee-saved registers, mxcsr and the
+// x87 control word go on the old stack, its rsp into *from.
+// Weak symbols in a comdat section, so every translation unit may emit them.
+__asm__(
+    ".pushsection .text.zonciu_fiber_switch,\"axG\",@progbits,zonciu_fiber_switch,comdat\n"
+    ".weak zonciu_fiber_switch\n"
+    ".type zonciu_fiber_switch,@function\n"
+    "zonciu_fiber_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size zonciu_fiber_switch,.-zonciu_fiber_switch\n"
+    ".popsection\n"
+    ".pushsection .text.zonciu_fiber_start,\"axG\",@progbits,zonciu_fiber_start,comdat\n"
+    ".weak zonciu_fiber_start\n"
+    ".type zonciu_fiber_start,@function\n"
+    "zonciu_fiber_start:\n"
+    "    movq %r12, %rdi\n"
+    "    callq *%r13\n"
+    "    ud2\n"
+    ".size zonciu_fiber_start,.-zonciu_fiber_start\n"
+    ".popsection\n");
+extern "C" void zonciu_fiber_switch(void** from, void* to);
+extern "C" void zonciu_fiber_start();
+#endif
+
+namespace zonciu
+{
+class FiberScheduler;
+namespace detail
+{
+struct FiberContext
+{
+#if defined(ZONCIU_FIBER_ASM)
+    FiberContext() : sp(nullptr) {}
+    void* sp;
+#else
+    ucontext_t uc;
+#endif
+};
+#if !defined(ZONCIU_FIBER_ASM)
+// makecontext only passes ints, the pointers travel in two halves
+typedef void(*FiberEntry)(void*);
+inline void FiberStartUc(unsigned int entry_hi, unsigned int entry_lo, unsigned int arg_hi, unsigned int arg_lo)
+{
+    std::uintptr_t entry = (static_cast<std::uintptr_t>(entry_hi) << 16 << 16) | entry_lo;
+    std::uintptr_t arg = (static_cast<std::uintptr_t>(arg_hi) << 16 << 16) | arg_lo;
+    reinterpret_cast<FiberEntry>(entry)(reinterpret_cast<void*>(arg));
+}
+#endif
+// Prepare [ctx] to run entry(arg) on [stack, stack + size) at the first switch
+inline void MakeContext(FiberContext& ctx, void* stack, std::size_t size, void(*entry)(void*), void* arg)
+{
+#if defined(ZONCIU_FIBER_ASM)
+    std::uintptr_t top = (reinterpret_cast<std::uintptr_t>(stack) + size) & ~static_cast<std::uintptr_t>(15);
+    // rsp after the final ret must be 16-byte aligned for the call in zonciu_fiber_start
+    void** frame = reinterpret_cast<void**>(top - 80);
+    std::uint32_t* control = reinterpret_cast<std::uint32_t*>(frame);
+    control[0] = 0x1f80; // default mxcsr
+    control[1] = 0x037f; // default x87 control word
+    frame[1] = nullptr;                                  // r15
+    frame[2] = nullptr;                                  // r14
+    frame[3] = reinterpret_cast<void*>(entry);           // r13
+    frame[4] = arg;                                      // r12
+    frame[5] = nullptr;                                  // rbx
+    frame[6] = nullptr;                                  // rbp
+    frame[7] = reinterpret_cast<void*>(&zonciu_fiber_start);
+    ctx.sp = frame;
+#else
+    getcontext(&ctx.uc);
+    ctx.uc.uc_stack.ss_sp = stack;
+    ctx.uc.uc_stack.ss_size = size;
+    ctx.uc.uc_link = nullptr;
+    std::uintptr_t func = reinterpret_cast<std::uintptr_t>(entry);
+    std::uintptr_t data = reinterpret_cast<std::uintptr_t>(arg);
+    makecontext(&ctx.uc, reinterpret_cast<void(*)()>(&FiberStartUc), 4,
+        static_cast<unsigned int>(func >> 16 >> 16), static_cast<unsigned int>(func),
+        static_cast<unsigned int>(data >> 16 >> 16), static_cast<unsigned int>(data));
+#endif
+}
+inline void SwitchContext(FiberContext& from, FiberContext& to)
+{
+#if defined(ZONCIU_FIBER_ASM)
+    zonciu_fiber_switch(&from.sp, to.sp);
+#else
+    swapcontext(&from.uc, &to.uc);
+#endif
+}
+/*
+ * mmap'd fiber stacks with a PROT_NONE guard page below, so an overflow
+ * faults instead of corrupting the neighbour. Freed stacks are cached.
+*/
+class FiberStackPool
+{
+public:
+    struct Stack
+    {
+        void* base;        // start of the mapping, guard page included
+        std::size_t size;  // usable bytes above the guard page
+        void* Bottom() const { return static_cast<char*>(base) + Page(); }
+    };
+    FiberStackPool(std::size_t stack_size, std::size_t cache)
+        :
+        _cache(cache)
+    {
+        std::size_t page = Page();
+        _size = (stack_size + page - 1) / page * page;
+        if (_size < page * 4)
+            _size = page * 4;
+    }
+    ~FiberStackPool()
+    {
+        for (auto& stack : _free)
+            munmap(stack.base, stack.size + Page());
+    }
+    Stack Acquire()
+    {
+        {
+            zonciu::SpinGuard lck(_lock);
+            if (!_free.empty())
+            {
+                Stack ret = _free.back();
+                _free.pop_back();
+                return ret;
+            }
+        }
+        Stack ret;
+        ret.size = _size;
+        ret.base = mmap(nullptr, _size + Page(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ret.base == MAP_FAILED)
+            throw std::bad_alloc();
+        if (mprotect(ret.base, Page(), PROT_NONE) != 0)
+        {
+            munmap(ret.base, _size + Page());
+            throw std::runtime_error("FiberStackPool: guard page failed");
+        }
+        return ret;
+    }
+    void Release(const Stack& stack)
+    {
+        {
+            zonciu::SpinGuard lck(_lock);
+            if (_free.size() < _cache)
+            {
+                _free.push_back(stack);
+                return;
+            }
+        }
+        munmap(stack.base, stack.size + Page());
+    }
+    std::size_t StackSize() const { return _size; }
+    static std::size_t Page()
+    {
+        static const std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        return page;
+    }
+private:
+    FiberStackPool(const FiberStackPool&) = delete;
+    FiberStackPool& operator=(const FiberStackPool&) = delete;
+    zonciu::SpinLock _lock;
+    std::vector<Stack> _free;
+    std::size_t _size;
+    std::size_t _cache;
+};
+struct Fiber
+{
+    FiberContext context;
+    FiberStackPool::Stack stack;
+    zonciu::InplaceFunction<void(), 48> func;
+    FiberScheduler* scheduler;
+};
+// Blocked fiber or thread in a FiberSemaphore/FiberMutex queue, lives on its stack
+struct FiberWaiter
+{
+    FiberWaiter() : fiber(nullptr), sema(nullptr), next(nullptr) {}
+    Fiber* fiber;
+    zonciu::Semaphore* sema;
+    FiberWaiter* next;
+};
+class FiberWaitQueue
+{
+public:
+    FiberWaitQueue() : _head(nullptr), _tail(nullptr) {}
+    void Push(FiberWaiter* waiter)
+    {
+        waiter->next = nullptr;
+        if (_tail)
+            _tail->next = waiter;
+        else
+            _head = waiter;
+        _tail = waiter;
+    }
+    FiberWaiter* Pop()
+    {
+        FiberWaiter* ret = _head;
+        if (ret)
+        {
+            _head = ret->next;
+            if (!_head)
+                _tail = nullptr;
+        }
+        return ret;
+    }
+    bool Empty() const { return !_head; }
+private:
+    FiberWaiter* _head;
+    FiberWaiter* _tail;
+};
+} // namespace detail
+
+/*
+ * M:N scheduler: fibers with their own stacks run on a few worker threads.
+ * Run queues are ThreadPool's detail::WorkQueues: fibers spawned or woken
+ * on a worker go to its Chase-Lev deque, the rest to the injection queue,
+ * idle workers steal and then park. A fiber may resume on another worker after
+ * it blocked, so never keep thread_local pointers across a blocking call.
+ * Blocking inside a fiber must go through this_fiber, FiberSemaphore or
+ * FiberMutex, anything else blocks the whole worker.
+ * The destructor waits for every fiber to finish.
+ * api:
+ * | Spawn      - start a fiber
+ * | Join       - wait until no fiber is left
+ * | FiberCount - live fibers
+*/
+class FiberScheduler
+{
+    typedef detail::Fiber Fiber;
+    struct Worker
+    {
+        explicit Worker(int _index) : index(_index), current(nullptr), after(nullptr), after_arg(nullptr) {}
+        int index;
+        detail::FiberContext context;
+        Fiber* current;
+        // runs on the worker stack right after the fiber switched out
+        void(*after)(void*);
+        void* after_arg;
+    };
+    struct Current
+    {
+        FiberScheduler* scheduler;
+        Worker* worker;
+    };
+public:
+    typedef zonciu::InplaceFunction<void(), 48> Func;
+    //thread_count: 0 = hardware_concurrency
+    //stack_size: bytes per fiber, rounded up to pages, plus one guard page
+    explicit FiberScheduler(unsigned int thread_count = 0, std::size_t stack_size = 128 * 1024)
+        :
+        _stacks(stack_size, 1024), _live(0), _queues(ThreadCount(thread_count)), _timer(1)
+    {
+        thread_count = static_cast<unsigned int>(_queues.Count());
+        // timer callbacks only requeue a fiber, run them on the timer thread
+        _timer.SetInlineBudget(std::chrono::microseconds(100));
+        for (unsigned int i = 0; i < thread_count; ++i)
+            _workers.emplace_back(new Worker(static_cast<int>(i)));
+        _threads.CreateWorkers(thread_count, Placement::none, "fiber",
+            [this](std::size_t i) { Run(_workers[i].get()); });
+    }
+    ~FiberScheduler()
+    {
+        Join();
+        _queues.Stop();
+        _threads.JoinAll();
+    }
+    void Spawn(Func func)
+    {
+        Fiber* fiber = new Fiber;
+        try
+        {
+            fiber->stack = _stacks.Acquire();
+        }
+        catch (...)
+        {
+            delete fiber;
+            throw;
+        }
+        fiber->func = std::move(func);
+        fiber->scheduler = this;
+        detail::MakeContext(fiber->context, fiber->stack.Bottom(), fiber->stack.size, &FiberScheduler::Entry, fiber);
+        _live.fetch_add(1, std::memory_order_relaxed);
+        Ready(fiber);
+    }
+    //Block until every fiber finished, call from outside the scheduler
+    void Join()
+    {
+        std::unique_lock<std::mutex> lck(_join_mutex);
+        _join_cv.wait(lck, [this]() { return _live.load(std::memory_order_acquire) == 0; });
+    }
+    size_t FiberCount() const { return _live.load(std::memory_order_relaxed); }
+    size_t WorkerCount() const { return _workers.size(); }
+    std::size_t StackSize() const { return _stacks.StackSize(); }
+    //Scheduler of the calling fiber, nullptr outside fibers
+    static FiberScheduler* Running()
+    {
+        Current& current = CurrentState();
+        return current.worker && current.worker->current ? current.scheduler : nullptr;
+    }
+    // Fiber side, used by this_fiber and the fiber primitives
+    static detail::Fiber* RunningFiber()
+    {
+        Current& current = CurrentState();
+        return current.worker ? current.worker->current : nullptr;
+    }
+    //Switch the calling fiber out; after(arg) runs on the worker once the
+    //fiber's registers are saved, so it may hand the fiber to another thread.
+    static void Suspend(void(*after)(void*), void* arg)
+    {
+        Current& current = CurrentState();
+        Worker* worker = current.worker;
+        Fiber* fiber = worker->current;
+        worker->after = after;
+        worker->after_arg = arg;
+        detail::SwitchContext(fiber->context, worker->context);
+        // may be another worker from here on
+    }
+    //Make a suspended fiber runnable, any thread
+    void Ready(Fiber* fiber)
+    {
+        Current& current = CurrentState();
+        _queues.Push(current.scheduler == this && current.worker ? current.worker->index : -1, fiber);
+    }
+    //Requeue a yielded fiber behind the others: the worker's own deque is
+    //LIFO and would hand it straight back
+    void Requeue(Fiber* fiber)
+    {
+        _queues.Push(-1, fiber);
+    }
+    zonciu::MinHeapTimer& Timer() { return _timer; }
+private:
+    // not inlined, a fiber may move between threads and the caller must
+    // never reuse a thread_local address computed before a switch
+    static ZONCIU_NOINLINE Current& CurrentState()
+    {
+        static thread_local Current current = { nullptr, nullptr };
+        return current;
+    }
+    static void Entry(void* arg)
+    {
+        Fiber* fiber = static_cast<Fiber*>(arg);
+        try
+        {
+            fiber->func();
+        }
+        catch (...)
+        {
+            // an exception cannot leave the fiber stack
+            std::terminate();
+        }
+        fiber->func.Reset();
+        Suspend(&FiberScheduler::Finish, fiber);
+    }
+    static void Finish(void* arg)
+    {
+        Fiber* fiber = static_cast<Fiber*>(arg);
+        FiberScheduler* scheduler = fiber->scheduler;
+        scheduler->_stacks.Release(fiber->stack);
+        delete fiber;
+        if (scheduler->_live.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            std::lock_guard<std::mutex> lck(scheduler->_join_mutex);
+            scheduler->_join_cv.notify_all();
+        }
+    }
+    static std::size_t ThreadCount(unsigned int thread_count)
+    {
+        if (thread_count == 0)
+            thread_count = std::thread::hardware_concurrency();
+        return thread_count == 0 ? 1 : thread_count;
+    }
+    void Run(Worker* worker)
+    {
+        Current& current = CurrentState();
+        current.scheduler = this;
+        current.worker = worker;
+        int idle = 0;
+        for (;;)
+        {
+            Fiber* fiber = nullptr;
+            if (_queues.Find(worker->index, fiber))
+            {
+                idle = 0;
+                worker->current = fiber;
+                detail::SwitchContext(worker->context, fiber->context);
+                worker->current = nullptr;
+                if (worker->after)
+                {
+                    void(*after)(void*) = worker->after;
+                    worker->after = nullptr;
+                    after(worker->after_arg);
+                }
+                continue;
+            }
+            if (_queues.Stopped() && !_queues.HasWork())
+                break;
+            _queues.Idle(idle);
+        }
+        current.scheduler = nullptr;
+        current.worker = nullptr;
+    }
+    FiberScheduler(const FiberScheduler&) = delete;
+    FiberScheduler& operator=(const FiberScheduler&) = delete;
+    detail::FiberStackPool _stacks;
+    std::atomic<std::size_t> _live;
+    detail::WorkQueues<Fiber*> _queues;
+    std::vector<std::unique_ptr<Worker>> _workers;
+    std::mutex _join_mutex;
+    std::condition_variable _join_cv;
+    zonciu::MinHeapTimer _timer;
+    zonciu::ThreadGroup _threads;
+}; // class FiberScheduler
+
+namespace detail
+{
+inline void FiberReady(void* arg)
+{
+    Fiber* fiber = static_cast<Fiber*>(arg);
+    fiber->scheduler->Ready(fiber);
+}
+inline void FiberRequeue(void* arg)
+{
+    Fiber* fiber = static_cast<Fiber*>(arg);
+    fiber->scheduler->Requeue(fiber);
+}
+inline void FiberUnlock(void* arg)
+{
+    static_cast<zonciu::SpinLock*>(arg)->unlock();
+}
+struct FiberSleep
+{
+    Fiber* fiber;
+    std::chrono::microseconds delay;
+};
+inline void FiberSleepStart(void* arg)
+{
+    FiberSleep* sleep = static_cast<FiberSleep*>(arg);
+    Fiber* fiber = sleep->fiber;
+    fiber->scheduler->Timer().SetTimeout(sleep->delay, [fiber]() { fiber->scheduler->Ready(fiber); });
+}
+// Park the caller on [queue], [lock] is held and released here
+inline void FiberBlock(FiberWaitQueue& queue, zonciu::SpinLock& lock)
+{
+    FiberWaiter waiter;
+    Fiber* fiber = FiberScheduler::RunningFiber();
+    if (fiber)
+    {
+        waiter.fiber = fiber;
+        queue.Push(&waiter);
+        // the lock stays held until the fiber is fully switched out
+        FiberScheduler::Suspend(&FiberUnlock, &lock);
+        return;
+    }
+    zonciu::Semaphore sema;
+    waiter.sema = &sema;
+    queue.Push(&waiter);
+    lock.unlock();
+    sema.Wait();
+}
+inline void FiberWake(FiberWaiter* waiter)
+{
+    // the waiter dies once woken, read it first
+    Fiber* fiber = waiter->fiber;
+    zonciu::Semaphore* sema = waiter->sema;
+    if (fiber)
+        fiber->scheduler->Ready(fiber);
+    else
+        sema->Signal();
+}
+} // namespace detail
+
+namespace this_fiber
+{
+//Inside a fiber
+inline bool InFiber() { return FiberScheduler::RunningFiber() != nullptr; }
+//Let other ready fibers run, outside a fiber yields the thread
+inline void Yield()
+{
+    detail::Fiber* fiber = FiberScheduler::RunningFiber();
+    if (!fiber)
+    {
+        std::this_thread::yield();
+        return;
+    }
+    FiberScheduler::Suspend(&detail::FiberRequeue, fiber);
+}
+//Suspend the fiber on the scheduler's MinHeapTimer, outside a fiber sleeps the thread
+template<class _Rep, class _Period>
+void SleepFor(std::chrono::duration<_Rep, _Period> duration)
+{
+    detail::Fiber* fiber = FiberScheduler::RunningFiber();
+    if (!fiber)
+    {
+        std::this_thread::sleep_for(duration);
+        return;
+    }
+    detail::FiberSleep sleep = { fiber, std::chrono::duration_cast<std::chrono::microseconds>(duration) };
+    if (sleep.delay.count() <= 0)
+    {
+        Yield();
+        return;
+    }
+    FiberScheduler::Suspend(&detail::FiberSleepStart, &sleep);
+}
+} // namespace this_fiber
+
+//Counting semaphore; a waiting fiber is suspended, a waiting thread blocks
+class FiberSemaphore
+{
+public:
+    explicit FiberSemaphore(int count = 0) : _count(count) {}
+    void Wait()
+    {
+        _lock.lock();
+        if (_count > 0)
+        {
+            --_count;
+            _lock.unlock();
+            return;
+        }
+        detail::FiberBlock(_waiters, _lock);
+    }
+    bool TryWait()
+    {
+        zonciu::SpinGuard lck(_lock);
+        if (_count <= 0)
+            return false;
+        --_count;
+        return true;
+    }
+    void Signal(int count = 1)
+    {
+        zonciu::SpinGuard lck(_lock);
+        while (count > 0 && !_waiters.Empty())
+        {
+            detail::FiberWake(_waiters.Pop());
+            --count;
+        }
+        _count += count;
+    }
+private:
+    FiberSemaphore(const FiberSemaphore&) = delete;
+    FiberSemaphore& operator=(const FiberSemaphore&) = delete;
+    zonciu::SpinLock _lock;
+    int _count;
+    detail::FiberWaitQueue _waiters;
+};
+//Mutex whose lock suspends the fiber instead of the worker, unlock hands
+//the mutex straight to the next waiter. Works with std::lock_guard.
+class FiberMutex
+{
+public:
+    FiberMutex() : _locked(false) {}
+    void lock()
+    {
+        _lock.lock();
+        if (!_locked)
+        {
+            _locked = true;
+            _lock.unlock();
+            return;
+        }
+        detail::FiberBlock(_waiters, _lock);
+    }
+    bool try_lock()
+    {
+        zonciu::SpinGuard lck(_lock);
+        if (_locked)
+            return false;
+        _locked = true;
+        return true;
+    }
+    void unlock()
+    {
+        zonciu::SpinGuard lck(_lock);
+        if (_waiters.Empty())
+            _locked = false;
+        else
+            detail::FiberWake(_waiters.Pop());
+    }
+private:
+    FiberMutex(const FiberMutex&) = delete;
+    FiberMutex& operator=(const FiberMutex&) = delete;
+    zonciu::SpinLock _lock;
+    bool _locked;
+    detail::FiberWaitQueue _waiters;
+};
+typedef std::lock_guard<FiberMutex> FiberGuard;
+} // namespace zonciu
+#endif // ZONCIU_FIBER_HPP
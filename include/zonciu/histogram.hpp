@@ -0,0 +1,137 @@
+/*
+* Copyright(c) 2016 Zonciu Liang.All rights reserved.
+* Use of this source code is governed by a BSD-style license that can be
+* found in the LICENSE file.
+*
+* Author:  Zonciu Liang
+* Contract: zonciu@zonciu.com
+* Description: lock-free log-linear histogram
+*/
+#ifndef ZONCIU_HISTOGRAM_HPP
+#define ZONCIU_HISTOGRAM_HPP
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+namespace zonciu
+{
+/*
+ * Lock-free histogram for latencies, sizes and counts.
+ * Record is a few relaxed atomic adds, safe from any number of threads.
+ * Buckets are log-linear: 4 per power of two, so a bucket is at most
+ * 25% wide; values 0-3 are exact.
+ * api:
+ * | Record   - add one value
+ * | Snap     - copy of the current counts
+ * | Reset
+ * | Snapshot::Percentile - upper bound of the bucket holding p (0-100)
+*/
+class Histogram
+{
+public:
+    enum
+    {
+        kSubBits = 2,
+        kSubCount = 1 << kSubBits,
+        kBuckets = (64 - kSubBits + 1) * kSubCount
+    };
+    struct Snapshot
+    {
+        std::uint64_t count;
+        std::uint64_t sum;
+        std::uint64_t max;
+        std::uint64_t buckets[kBuckets];
+        double Mean() const { return count ? static_cast<double>(sum) / count : 0.0; }
+        std::uint64_t Percentile(double p) const
+        {
+            if (!count)
+                return 0;
+            std::uint64_t rank = static_cast<std::uint64_t>(p / 100.0 * count + 0.5);
+            if (rank < 1)
+                rank = 1;
+            std::uint64_t seen = 0;
+            for (std::size_t i = 0; i < kBuckets; ++i)
+            {
+                seen += buckets[i];
+                if (seen >= rank)
+                {
+                    std::uint64_t upper = UpperBound(i);
+                    return upper < max ? upper : max;
+                }
+            }
+            return max;
+        }
+    };
+    Histogram() { Reset(); }
+    void Record(std::uint64_t value)
+    {
+        _buckets[Index(value)].fetch_add(1, std::memory_order_relaxed);
+        _count.fetch_add(1, std::memory_order_relaxed);
+        _sum.fetch_add(value, std::memory_order_relaxed);
+        std::uint64_t max = _max.load(std::memory_order_relaxed);
+        while (value > max && !_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+    }
+    //Counts recorded concurrently may be split between fields
+    Snapshot Snap() const
+    {
+        Snapshot ret;
+        ret.count = _count.load(std::memory_order_relaxed);
+        ret.sum = _sum.load(std::memory_order_relaxed);
+        ret.max = _max.load(std::memory_order_relaxed);
+        for (std::size_t i = 0; i < kBuckets; ++i)
+            ret.buckets[i] = _buckets[i].load(std::memory_order_relaxed);
+        return ret;
+    }
+    void Reset()
+    {
+        for (auto& bucket : _buckets)
+            bucket.store(0, std::memory_order_relaxed);
+        _count.store(0, std::memory_order_relaxed);
+        _sum.store(0, std::memory_order_relaxed);
+        _max.store(0, std::memory_order_relaxed);
+    }
+    static std::size_t Index(std::uint64_t value)
+    {
+        if (value < kSubCount)
+            return static_cast<std::size_t>(value);
+        unsigned int exp = Log2(value);
+        std::uint64_t sub = (value >> (exp - kSubBits)) & (kSubCount - 1);
+        return static_cast<std::size_t>((exp - kSubBits + 1) * kSubCount + sub);
+    }
+    // Largest value that lands in bucket [index]
+    static std::uint64_t UpperBound(std::size_t index)
+    {
+        if (index < kSubCount)
+            return index;
+        unsigned int exp = static_cast<unsigned int>(index / kSubCount) + kSubBits - 1;
+        std::uint64_t sub = index % kSubCount;
+        std::uint64_t low = (1ULL << exp) | (sub << (exp - kSubBits));
+        return low + (1ULL << (exp - kSubBits)) - 1;
+    }
+private:
+    static unsigned int Log2(std::uint64_t value)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return 63u - static_cast<unsigned int>(__builtin_clzll(value));
+#elif defined(_MSC_VER) && defined(_M_X64)
+        unsigned long ret;
+        _BitScanReverse64(&ret, value);
+        return ret;
+#else
+        unsigned int ret = 0;
+        while (value >>= 1)
+            ++ret;
+        return ret;
+#endif
+    }
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+    std::atomic<std::uint64_t> _buckets[kBuckets];
+    std::atomic<std::uint64_t> _count;
+    std::atomic<std::uint64_t> _sum;
+    std::atomic<std::uint64_t> _max;
+}; // class Histogram
+} // namespace zonciu
+#endif // ZONCIU_HISTOGRAM_HPP
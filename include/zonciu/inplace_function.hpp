@@ -0,0 +1,148 @@
+/*
+* Copyright(c) 2016 Zonciu Liang.All rights reserved.
+* Use of this source code is governed by a BSD-style license that can be
+* found in the LICENSE file.
+*
+* Author:  Zonciu Liang
+* Contract: zonciu@zonciu.com
+* Description: move-only function wrapper with inline storage
+*/
+#ifndef ZONCIU_INPLACE_FUNCTION_HPP
+#define ZONCIU_INPLACE_FUNCTION_HPP
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+namespace zonciu
+{
+template<class Signature, std::size_t Capacity = 48>
+class InplaceFunction;
+
+//Like std::function, but move-only.
+//Callables up to [Capacity] bytes with a nothrow move are stored inline,
+//bigger ones fall back to the heap.
+template<class R, class...Args, std::size_t Capacity>
+class InplaceFunction<R(Args...), Capacity>
+{
+    typedef typename std::aligned_storage<Capacity, alignof(std::max_align_t)>::type Storage;
+    struct VTable
+    {
+        R(*invoke)(void*, Args&&...);
+        void(*move)(void* dst, void* src);
+        void(*destroy)(void*);
+    };
+    template<class F>
+    struct Inline
+    {
+        static R Invoke(void* p, Args&&...args)
+        {
+            return (*static_cast<F*>(p))(std::forward<Args>(args)...);
+        }
+        static void Move(void* dst, void* src)
+        {
+            ::new (dst) F(std::move(*static_cast<F*>(src)));
+            static_cast<F*>(src)->~F();
+        }
+        static void Destroy(void* p) { static_cast<F*>(p)->~F(); }
+        static const VTable* Table()
+        {
+            static const VTable table = { &Invoke, &Move, &Destroy };
+            return &table;
+        }
+    };
+    template<class F>
+    struct Heap
+    {
+        static R Invoke(void* p, Args&&...args)
+        {
+            return (**static_cast<F**>(p))(std::forward<Args>(args)...);
+        }
+        static void Move(void* dst, void* src)
+        {
+            *static_cast<F**>(dst) = *static_cast<F**>(src);
+        }
+        static void Destroy(void* p) { delete *static_cast<F**>(p); }
+        static const VTable* Table()
+        {
+            static const VTable table = { &Invoke, &Move, &Destroy };
+            return &table;
+        }
+    };
+    template<class F>
+    struct IsInline
+        : std::integral_constant<bool,
+        sizeof(F) <= Capacity
+        && alignof(std::max_align_t) % alignof(F) == 0
+        && std::is_nothrow_move_constructible<F>::value>
+    {};
+public:
+    InplaceFunction() : _vtable(nullptr) {}
+    InplaceFunction(std::nullptr_t) : _vtable(nullptr) {}
+    template<class F, class = typename std::enable_if<
+        !std::is_same<typename std::decay<F>::type, InplaceFunction>::value>::type>
+    InplaceFunction(F&& func) : _vtable(nullptr)
+    {
+        Construct<typename std::decay<F>::type>(std::forward<F>(func),
+            IsInline<typename std::decay<F>::type>());
+    }
+    InplaceFunction(InplaceFunction&& other) : _vtable(other._vtable)
+    {
+        if (_vtable)
+        {
+            _vtable->move(&_storage, &other._storage);
+            other._vtable = nullptr;
+        }
+    }
+    InplaceFunction& operator=(InplaceFunction&& other)
+    {
+        if (this != &other)
+        {
+            Reset();
+            if (other._vtable)
+            {
+                other._vtable->move(&_storage, &other._storage);
+                _vtable = other._vtable;
+                other._vtable = nullptr;
+            }
+        }
+        return *this;
+    }
+    InplaceFunction& operator=(std::nullptr_t)
+    {
+        Reset();
+        return *this;
+    }
+    ~InplaceFunction() { Reset(); }
+    R operator()(Args...args) const
+    {
+        return _vtable->invoke(const_cast<Storage*>(&_storage), std::forward<Args>(args)...);
+    }
+    explicit operator bool() const { return _vtable != nullptr; }
+    void Reset()
+    {
+        if (_vtable)
+        {
+            _vtable->destroy(&_storage);
+            _vtable = nullptr;
+        }
+    }
+private:
+    template<class F, class T>
+    void Construct(T&& func, std::true_type)
+    {
+        ::new (static_cast<void*>(&_storage)) F(std::forward<T>(func));
+        _vtable = Inline<F>::Table();
+    }
+    template<class F, class T>
+    void Construct(T&& func, std::false_type)
+    {
+        *reinterpret_cast<F**>(&_storage) = new F(std::forward<T>(func));
+        _vtable = Heap<F>::Table();
+    }
+    InplaceFunction(const InplaceFunction&) = delete;
+    InplaceFunction& operator=(const InplaceFunction&) = delete;
+    Storage _storage;
+    const VTable* _vtable;
+};
+} // namespace zonciu
+#endif // ZONCIU_INPLACE_FUNCTION_HPP
@@ -9,11 +9,34 @@
 */
 #ifndef ZONCIU_LOCK_HPP
 #define ZONCIU_LOCK_HPP
+#include <stdint.h>
 #include <atomic>
 #include <thread>
 #include <mutex>
+#include <vector>
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#endif
+// over-aligned new only honours alignas from C++17, before that the padding
+// still keeps neighbours off the lock's line when allocated on the heap
+#if defined(__cpp_aligned_new)
+#define ZONCIU_CACHE_ALIGNED alignas(64)
+#else
+#define ZONCIU_CACHE_ALIGNED
+#endif
 namespace zonciu
 {
+//Busy-wait hint, lets the sibling hyper-thread run and saves power
+inline void CpuRelax()
+{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+    _mm_pause();
+#elif defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || (defined(__arm__) && __ARM_ARCH >= 7)
+    __asm__ __volatile__("yield");
+#endif
+}
 class SpinLock
 {
 public:
@@ -80,7 +103,312 @@ private:
     std::thread::id owner_;
 };
 
+namespace detail
+{
+//Pause while spinning, give the cpu away now and then in case the
+//thread we wait for is not running
+inline void SpinPause(int& spins)
+{
+    if (++spins < 64)
+    {
+        CpuRelax();
+        return;
+    }
+    spins = 0;
+    std::this_thread::yield();
+}
+//Per-thread free list of queue lock nodes. A node goes back to the list
+//when its lock is released, so locks nest in any order.
+template<typename _Node>
+class QueueNodeCache
+{
+public:
+    static _Node* Get()
+    {
+        std::vector<_Node*>& nodes = Instance()._nodes;
+        if (nodes.empty())
+            return new _Node;
+        _Node* ret = nodes.back();
+        nodes.pop_back();
+        return ret;
+    }
+    static void Put(_Node* node) { Instance()._nodes.push_back(node); }
+private:
+    ~QueueNodeCache()
+    {
+        for (auto node : _nodes)
+            delete node;
+    }
+    static QueueNodeCache& Instance()
+    {
+        static thread_local QueueNodeCache cache;
+        return cache;
+    }
+    std::vector<_Node*> _nodes;
+};
+} // namespace detail
+//Lock word policies for BasicSpinLock
+namespace spin_policy
+{
+//Test-and-test-and-set: spin reading the flag, only write when it looks free
+class Ttas
+{
+public:
+    Ttas() : _locked(false) {}
+    void lock()
+    {
+        int spins = 0;
+        while (_locked.exchange(true, std::memory_order_acquire))
+        {
+            while (_locked.load(std::memory_order_relaxed))
+                detail::SpinPause(spins);
+        }
+    }
+    bool try_lock()
+    {
+        return !_locked.load(std::memory_order_relaxed) && !_locked.exchange(true, std::memory_order_acquire);
+    }
+    void unlock() { _locked.store(false, std::memory_order_release); }
+private:
+    std::atomic<bool> _locked;
+};
+//TTAS that waits exponentially longer after every lost race, up to a bound,
+//so losers stop bouncing the line while the holder works
+class Backoff
+{
+public:
+    enum { kMinDelay = 4, kMaxDelay = 1024 };
+    Backoff() : _locked(false) {}
+    void lock()
+    {
+        int delay = kMinDelay;
+        while (_locked.exchange(true, std::memory_order_acquire))
+        {
+            do
+            {
+                if (delay >= kMaxDelay)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                for (int i = 0; i < delay; ++i)
+                    CpuRelax();
+                delay *= 2;
+            } while (_locked.load(std::memory_order_relaxed));
+        }
+    }
+    bool try_lock()
+    {
+        return !_locked.load(std::memory_order_relaxed) && !_locked.exchange(true, std::memory_order_acquire);
+    }
+    void unlock() { _locked.store(false, std::memory_order_release); }
+private:
+    std::atomic<bool> _locked;
+};
+//Ticket lock: FIFO, waiters pause in proportion to their place in line
+class Ticket
+{
+public:
+    Ticket() : _next(0), _serving(0) {}
+    void lock()
+    {
+        uint32_t ticket = _next.fetch_add(1, std::memory_order_relaxed);
+        int spins = 0;
+        for (;;)
+        {
+            uint32_t serving = _serving.load(std::memory_order_acquire);
+            if (serving == ticket)
+                return;
+            for (uint32_t i = ticket - serving; i > 1; --i)
+                CpuRelax();
+            detail::SpinPause(spins);
+        }
+    }
+    bool try_lock()
+    {
+        uint32_t serving = _serving.load(std::memory_order_acquire);
+        uint32_t expected = serving;
+        return _next.compare_exchange_strong(expected, serving + 1, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+    // only the holder writes _serving
+    void unlock() { _serving.store(_serving.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+private:
+    std::atomic<uint32_t> _next;
+    std::atomic<uint32_t> _serving;
+};
+} // namespace spin_policy
+/*
+ * Spin lock with the lock word chosen by _Policy (spin_policy::Ttas,
+ * Backoff, Ticket), alone on a 64-byte cache line. Lockable, so
+ * std::lock_guard / BasicSpinGuard work like SpinGuard does.
+*/
+template<typename _Policy>
+class ZONCIU_CACHE_ALIGNED BasicSpinLock
+{
+public:
+    BasicSpinLock() = default;
+    void lock() { _policy.lock(); }
+    bool try_lock() { return _policy.try_lock(); }
+    void unlock() { _policy.unlock(); }
+private:
+    BasicSpinLock(const BasicSpinLock&) = delete;
+    const BasicSpinLock& operator=(const BasicSpinLock&) = delete;
+    _Policy _policy;
+    char _pad[64 - sizeof(_Policy) % 64];
+};
+typedef BasicSpinLock<spin_policy::Ttas> TtasSpinLock;
+typedef BasicSpinLock<spin_policy::Backoff> BackoffSpinLock;
+typedef BasicSpinLock<spin_policy::Ticket> TicketSpinLock;
+
+/*
+ * MCS queue lock: waiters line up in a linked list and each spins on its
+ * own node, the holder hands the lock to the next one in FIFO order.
+ * Only the tail is shared, one cache line moves per hand-off.
+ * Nodes come from a per-thread cache, lock/unlock need no arguments.
+*/
+class McsLock
+{
+    struct Node
+    {
+        Node() : next(nullptr), locked(false) {}
+        std::atomic<Node*> next;
+        std::atomic<bool> locked;
+        char pad[64 - sizeof(std::atomic<Node*>) - sizeof(std::atomic<bool>)];
+    };
+    typedef detail::QueueNodeCache<Node> Cache;
+public:
+    McsLock() : _tail(nullptr), _holder(nullptr) {}
+    void lock()
+    {
+        Node* node = Cache::Get();
+        node->next.store(nullptr, std::memory_order_relaxed);
+        node->locked.store(true, std::memory_order_relaxed);
+        Node* prev = _tail.exchange(node, std::memory_order_acq_rel);
+        if (prev)
+        {
+            prev->next.store(node, std::memory_order_release);
+            int spins = 0;
+            while (node->locked.load(std::memory_order_acquire))
+                detail::SpinPause(spins);
+        }
+        _holder = node;
+    }
+    bool try_lock()
+    {
+        Node* node = Cache::Get();
+        node->next.store(nullptr, std::memory_order_relaxed);
+        Node* expected = nullptr;
+        if (!_tail.compare_exchange_strong(expected, node, std::memory_order_acquire, std::memory_order_relaxed))
+        {
+            Cache::Put(node);
+            return false;
+        }
+        _holder = node;
+        return true;
+    }
+    void unlock()
+    {
+        Node* node = _holder;
+        Node* next = node->next.load(std::memory_order_acquire);
+        if (!next)
+        {
+            Node* expected = node;
+            if (_tail.compare_exchange_strong(expected, nullptr, std::memory_order_release, std::memory_order_relaxed))
+            {
+                Cache::Put(node);
+                return;
+            }
+            // a waiter swapped the tail but has not linked itself yet
+            int spins = 0;
+            while (!(next = node->next.load(std::memory_order_acquire)))
+                detail::SpinPause(spins);
+        }
+        next->locked.store(false, std::memory_order_release);
+        Cache::Put(node);
+    }
+private:
+    McsLock(const McsLock&) = delete;
+    const McsLock& operator=(const McsLock&) = delete;
+    std::atomic<Node*> _tail;
+    // written by the holder only
+    Node* _holder;
+};
+/*
+ * CLH queue lock: each waiter spins on the node of the one before it.
+ * Release is a single store, no compare-exchange; the releasing thread
+ * keeps its predecessor's node for its next acquisition.
+ * Nodes come from a per-thread cache, lock/unlock need no arguments.
+*/
+class ClhLock
+{
+    struct Node
+    {
+        Node() : locked(false) {}
+        std::atomic<bool> locked;
+        char pad[64 - sizeof(std::atomic<bool>)];
+    };
+    typedef detail::QueueNodeCache<Node> Cache;
+public:
+    ClhLock() : _tail(new Node), _holder(nullptr), _pred(nullptr) {}
+    ~ClhLock() { delete _tail.load(std::memory_order_relaxed); }
+    void lock()
+    {
+        Node* node = Cache::Get();
+        node->locked.store(true, std::memory_order_relaxed);
+        Node* pred = _tail.exchange(node, std::memory_order_acq_rel);
+        int spins = 0;
+        while (pred->locked.load(std::memory_order_acquire))
+            detail::SpinPause(spins);
+        _holder = node;
+        _pred = pred;
+    }
+    bool try_lock()
+    {
+        Node* pred = _tail.load(std::memory_order_acquire);
+        if (pred->locked.load(std::memory_order_acquire))
+            return false;
+        Node* node = Cache::Get();
+        node->locked.store(true, std::memory_order_relaxed);
+        if (!_tail.compare_exchange_strong(pred, node, std::memory_order_acq_rel, std::memory_order_relaxed))
+        {
+            Cache::Put(node);
+            return false;
+        }
+        // the tail may have been recycled and relocked in between (ABA),
+        // we are queued now, so wait for it like lock does
+        int spins = 0;
+        while (pred->locked.load(std::memory_order_acquire))
+            detail::SpinPause(spins);
+        _holder = node;
+        _pred = pred;
+        return true;
+    }
+    void unlock()
+    {
+        // the next holder overwrites both once the store lands
+        Node* node = _holder;
+        Node* pred = _pred;
+        // nobody spins on pred any more, it is ours now
+        node->locked.store(false, std::memory_order_release);
+        Cache::Put(pred);
+    }
+private:
+    ClhLock(const ClhLock&) = delete;
+    const ClhLock& operator=(const ClhLock&) = delete;
+    std::atomic<Node*> _tail;
+    // written by the holder only
+    Node* _holder;
+    Node* _pred;
+};
+
 typedef std::lock_guard<SpinLock> SpinGuard;
 typedef std::lock_guard<RecursiveSpinLock> RecursiveSpinGuard;
+typedef std::lock_guard<McsLock> McsGuard;
+template<typename _Policy>
+using BasicSpinGuard = std::lock_guard<BasicSpinLock<_Policy>>;
+typedef BasicSpinGuard<spin_policy::Ttas> TtasSpinGuard;
+typedef BasicSpinGuard<spin_policy::Backoff> BackoffSpinGuard;
+typedef BasicSpinGuard<spin_policy::Ticket> TicketSpinGuard;
+typedef std::lock_guard<ClhLock> ClhGuard;
 }
 #endif
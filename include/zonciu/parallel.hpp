@@ -0,0 +1,378 @@
+/*
+* Copyright(c) 2016 Zonciu Liang.All rights reserved.
+* Use of this source code is governed by a BSD-style license that can be
+* found in the LICENSE file.
+*
+* Author:  Zonciu Liang
+* Contract: zonciu@zonciu.com
+* Description: data-parallel algorithms on ThreadPool
+*/
+#ifndef ZONCIU_PARALLEL_HPP
+#define ZONCIU_PARALLEL_HPP
+#include "zonciu/thread_pool.hpp"
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+/*
+ * Fork-join algorithms: ranges split in halves recursively, one half is
+ * posted to the pool and the other runs here, idle workers steal the
+ * posted halves. A thread waiting for its half runs other pool tasks
+ * meanwhile, so nesting never blocks a worker.
+ * Every call takes an optional ThreadPool, DefaultThreadPool otherwise.
+ * grain: leaf size, 0 = about 8 leaves per worker.
+ * api:
+ * | parallel_for        - func(i) for i in [first, last)
+ * | parallel_reduce     - combine(func(i)...) for i in [first, last)
+ * | parallel_scan       - inclusive prefix scan, like std::partial_sum
+ * | parallel_sort       - stable merge sort
+ * | parallel_radix_sort - LSD radix sort on integer keys
+*/
+namespace zonciu
+{
+//Shared pool for the overloads without a pool argument, created on first use
+inline ThreadPool& DefaultThreadPool()
+{
+    static ThreadPool pool;
+    return pool;
+}
+namespace detail
+{
+// Run right on the pool and left here, return when both are done.
+// The first exception of the two is rethrown.
+template<class F1, class F2>
+void Fork2(ThreadPool& pool, F1&& left, F2&& right)
+{
+    std::atomic<bool> done(false);
+    std::exception_ptr right_error;
+    pool.Post([&done, &right_error, &right]()
+    {
+        try
+        {
+            right();
+        }
+        catch (...)
+        {
+            right_error = std::current_exception();
+        }
+        done.store(true, std::memory_order_release);
+    });
+    std::exception_ptr left_error;
+    try
+    {
+        left();
+    }
+    catch (...)
+    {
+        left_error = std::current_exception();
+    }
+    while (!done.load(std::memory_order_acquire))
+    {
+        if (!pool.TryRunOne())
+            std::this_thread::yield();
+    }
+    if (left_error)
+        std::rethrow_exception(left_error);
+    if (right_error)
+        std::rethrow_exception(right_error);
+}
+inline std::size_t AutoGrain(ThreadPool& pool, std::size_t count, std::size_t grain)
+{
+    if (grain)
+        return grain;
+    std::size_t leaves = pool.WorkerCount() * 8;
+    return std::max<std::size_t>(1, count / (leaves ? leaves : 1));
+}
+template<class Index, class Func>
+void ForRange(ThreadPool& pool, Index first, Index last, Func& func, std::size_t grain)
+{
+    if (static_cast<std::size_t>(last - first) <= grain)
+    {
+        for (Index i = first; i < last; ++i)
+            func(i);
+        return;
+    }
+    Index mid = first + (last - first) / 2;
+    Fork2(pool,
+        [&]() { ForRange(pool, first, mid, func, grain); },
+        [&]() { ForRange(pool, mid, last, func, grain); });
+}
+template<class T, class Index, class Func, class Combine>
+T ReduceRange(ThreadPool& pool, Index first, Index last, const T& identity, Func& func, Combine& combine,
+    std::size_t grain)
+{
+    if (static_cast<std::size_t>(last - first) <= grain)
+    {
+        T ret = identity;
+        for (Index i = first; i < last; ++i)
+            ret = combine(std::move(ret), func(i));
+        return ret;
+    }
+    Index mid = first + (last - first) / 2;
+    T left = identity;
+    T right = identity;
+    Fork2(pool,
+        [&]() { left = ReduceRange(pool, first, mid, identity, func, combine, grain); },
+        [&]() { right = ReduceRange(pool, mid, last, identity, func, combine, grain); });
+    return combine(std::move(left), std::move(right));
+}
+// Stable parallel merge of [x, x_end) and [y, y_end) into out, moves elements
+template<class It, class Out, class Compare>
+void MergeRange(ThreadPool& pool, It x, It x_end, It y, It y_end, Out out, Compare& comp, std::size_t grain)
+{
+    std::size_t x_size = static_cast<std::size_t>(x_end - x);
+    std::size_t y_size = static_cast<std::size_t>(y_end - y);
+    if (x_size + y_size <= grain)
+    {
+        std::merge(std::make_move_iterator(x), std::make_move_iterator(x_end),
+            std::make_move_iterator(y), std::make_move_iterator(y_end), out, comp);
+        return;
+    }
+    It x_mid, y_mid;
+    if (x_size >= y_size)
+    {
+        // equal keys of x stay before those of y
+        x_mid = x + x_size / 2;
+        y_mid = std::lower_bound(y, y_end, *x_mid, comp);
+    }
+    else
+    {
+        y_mid = y + y_size / 2;
+        x_mid = std::upper_bound(x, x_end, *y_mid, comp);
+    }
+    Out out_mid = out + ((x_mid - x) + (y_mid - y));
+    Fork2(pool,
+        [&]() { MergeRange(pool, x, x_mid, y, y_mid, out, comp, grain); },
+        [&]() { MergeRange(pool, x_mid, x_end, y_mid, y_end, out_mid, comp, grain); });
+}
+// Sort [first, first + n) of data, result ends up in buf when to_buf, else in data
+template<class It, class Buf, class Compare>
+void SortRange(ThreadPool& pool, It data, Buf buf, std::size_t n, bool to_buf, Compare& comp, std::size_t grain)
+{
+    if (n <= grain)
+    {
+        std::stable_sort(data, data + n, comp);
+        if (to_buf)
+            std::move(data, data + n, buf);
+        return;
+    }
+    std::size_t half = n / 2;
+    // halves land in the other array, the merge brings them back
+    Fork2(pool,
+        [&]() { SortRange(pool, data, buf, half, !to_buf, comp, grain); },
+        [&]() { SortRange(pool, data + half, buf + half, n - half, !to_buf, comp, grain); });
+    if (to_buf)
+        MergeRange(pool, data, data + half, data + half, data + n, buf, comp, grain);
+    else
+        MergeRange(pool, buf, buf + half, buf + half, buf + n, data, comp, grain);
+}
+// Radix key: unsigned, with the sign bit flipped for signed types so order holds
+template<class K>
+typename std::make_unsigned<K>::type RadixKey(K key)
+{
+    typedef typename std::make_unsigned<K>::type U;
+    U ret = static_cast<U>(key);
+    if (std::is_signed<K>::value)
+        ret ^= static_cast<U>(U(1) << (sizeof(U) * 8 - 1));
+    return ret;
+}
+struct IdentityKey
+{
+    template<class T>
+    T operator()(const T& value) const { return value; }
+};
+} // namespace detail
+
+//func(i) for every i in [first, last), Index is an integer type
+template<class Index, class Func>
+void parallel_for(ThreadPool& pool, Index first, Index last, Func func, std::size_t grain = 0)
+{
+    if (!(first < last))
+        return;
+    grain = detail::AutoGrain(pool, static_cast<std::size_t>(last - first), grain);
+    detail::ForRange(pool, first, last, func, grain);
+}
+template<class Index, class Func>
+void parallel_for(Index first, Index last, Func func, std::size_t grain = 0)
+{
+    parallel_for(DefaultThreadPool(), first, last, std::move(func), grain);
+}
+//combine(... combine(identity, func(first)) ..., func(last - 1)), combine must be associative
+template<class Index, class T, class Func, class Combine>
+T parallel_reduce(ThreadPool& pool, Index first, Index last, T identity, Func func, Combine combine,
+    std::size_t grain = 0)
+{
+    if (!(first < last))
+        return identity;
+    grain = detail::AutoGrain(pool, static_cast<std::size_t>(last - first), grain);
+    return detail::ReduceRange(pool, first, last, identity, func, combine, grain);
+}
+template<class Index, class T, class Func, class Combine>
+T parallel_reduce(Index first, Index last, T identity, Func func, Combine combine, std::size_t grain = 0)
+{
+    return parallel_reduce(DefaultThreadPool(), first, last, std::move(identity), std::move(func),
+        std::move(combine), grain);
+}
+//Inclusive scan of [first, last) into out, op must be associative.
+//Two passes over blocks: block totals in parallel, offsets in order, then
+//each block scans again from its offset. Return end of output.
+template<class InIt, class OutIt, class T, class Op>
+OutIt parallel_scan(ThreadPool& pool, InIt first, InIt last, OutIt out, T identity, Op op)
+{
+    std::size_t n = static_cast<std::size_t>(last - first);
+    if (!n)
+        return out;
+    std::size_t blocks = std::min<std::size_t>(n, pool.WorkerCount() * 4);
+    std::size_t block_size = (n + blocks - 1) / blocks;
+    blocks = (n + block_size - 1) / block_size;
+    std::vector<T> sums(blocks, identity);
+    parallel_for(pool, std::size_t(0), blocks, [&](std::size_t b)
+    {
+        T sum = identity;
+        for (std::size_t i = b * block_size, end = std::min(n, i + block_size); i < end; ++i)
+            sum = op(sum, first[i]);
+        sums[b] = sum;
+    }, 1);
+    T carry = identity;
+    for (std::size_t b = 0; b < blocks; ++b)
+    {
+        T next = op(carry, sums[b]);
+        sums[b] = carry;
+        carry = next;
+    }
+    parallel_for(pool, std::size_t(0), blocks, [&](std::size_t b)
+    {
+        T sum = sums[b];
+        for (std::size_t i = b * block_size, end = std::min(n, i + block_size); i < end; ++i)
+        {
+            sum = op(sum, first[i]);
+            out[i] = sum;
+        }
+    }, 1);
+    return out + n;
+}
+template<class InIt, class OutIt, class T, class Op>
+OutIt parallel_scan(InIt first, InIt last, OutIt out, T identity, Op op)
+{
+    return parallel_scan(DefaultThreadPool(), first, last, out, std::move(identity), std::move(op));
+}
+//Stable merge sort, both the halves and the merges run in parallel.
+//Needs n default-constructed elements of scratch space.
+template<class RandomIt, class Compare>
+void parallel_sort(ThreadPool& pool, RandomIt first, RandomIt last, Compare comp, std::size_t grain = 0)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type T;
+    std::size_t n = static_cast<std::size_t>(last - first);
+    if (n < 2)
+        return;
+    // a leaf below a few thousand elements costs more to fork than to sort
+    grain = std::max<std::size_t>(detail::AutoGrain(pool, n, grain), 2048);
+    std::vector<T> buf(n);
+    detail::SortRange(pool, first, buf.begin(), n, false, comp, grain);
+}
+template<class RandomIt>
+void parallel_sort(ThreadPool& pool, RandomIt first, RandomIt last)
+{
+    parallel_sort(pool, first, last, std::less<typename std::iterator_traits<RandomIt>::value_type>());
+}
+template<class RandomIt, class Compare>
+void parallel_sort(RandomIt first, RandomIt last, Compare comp)
+{
+    parallel_sort(DefaultThreadPool(), first, last, std::move(comp));
+}
+template<class RandomIt>
+void parallel_sort(RandomIt first, RandomIt last)
+{
+    parallel_sort(DefaultThreadPool(), first, last);
+}
+//LSD radix sort, 8 bits per pass, stable.
+//key(value) must return an integer type; passes whose digit is the same
+//for every element are skipped.
+template<class RandomIt, class KeyFunc>
+void parallel_radix_sort(ThreadPool& pool, RandomIt first, RandomIt last, KeyFunc key)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type T;
+    typedef typename std::decay<decltype(key(*first))>::type K;
+    static_assert(std::is_integral<K>::value, "parallel_radix_sort: key must be an integer");
+    const std::size_t kRadix = 256;
+    std::size_t n = static_cast<std::size_t>(last - first);
+    if (n < 2)
+        return;
+    std::size_t blocks = std::min<std::size_t>(pool.WorkerCount() * 4, (n + 4095) / 4096);
+    if (!blocks)
+        blocks = 1;
+    std::size_t block_size = (n + blocks - 1) / blocks;
+    blocks = (n + block_size - 1) / block_size;
+    std::vector<T> buf(n);
+    std::vector<std::size_t> counts(blocks * kRadix);
+    bool in_buf = false;
+    for (unsigned int shift = 0; shift < sizeof(K) * 8; shift += 8)
+    {
+        std::fill(counts.begin(), counts.end(), 0);
+        auto src = [&](std::size_t i) -> T& { return in_buf ? buf[i] : first[i]; };
+        parallel_for(pool, std::size_t(0), blocks, [&](std::size_t b)
+        {
+            std::size_t* count = &counts[b * kRadix];
+            for (std::size_t i = b * block_size, end = std::min(n, i + block_size); i < end; ++i)
+                ++count[(detail::RadixKey(key(src(i))) >> shift) & (kRadix - 1)];
+        }, 1);
+        // offsets: digit-major, block-minor keeps the sort stable
+        std::size_t offset = 0;
+        bool trivial = false;
+        for (std::size_t digit = 0; digit < kRadix; ++digit)
+        {
+            std::size_t total = 0;
+            for (std::size_t b = 0; b < blocks; ++b)
+            {
+                std::size_t count = counts[b * kRadix + digit];
+                counts[b * kRadix + digit] = offset + total;
+                total += count;
+            }
+            if (total == n)
+                trivial = true;
+            offset += total;
+        }
+        if (trivial)
+            continue;
+        parallel_for(pool, std::size_t(0), blocks, [&](std::size_t b)
+        {
+            std::size_t* position = &counts[b * kRadix];
+            for (std::size_t i = b * block_size, end = std::min(n, i + block_size); i < end; ++i)
+            {
+                T& value = src(i);
+                std::size_t to = position[(detail::RadixKey(key(value)) >> shift) & (kRadix - 1)]++;
+                if (in_buf)
+                    first[to] = std::move(value);
+                else
+                    buf[to] = std::move(value);
+            }
+        }, 1);
+        in_buf = !in_buf;
+    }
+    if (in_buf)
+        std::move(buf.begin(), buf.end(), first);
+}
+template<class RandomIt>
+void parallel_radix_sort(ThreadPool& pool, RandomIt first, RandomIt last)
+{
+    parallel_radix_sort(pool, first, last, detail::IdentityKey());
+}
+template<class RandomIt, class KeyFunc>
+void parallel_radix_sort(RandomIt first, RandomIt last, KeyFunc key)
+{
+    parallel_radix_sort(DefaultThreadPool(), first, last, std::move(key));
+}
+template<class RandomIt>
+void parallel_radix_sort(RandomIt first, RandomIt last)
+{
+    parallel_radix_sort(DefaultThreadPool(), first, last);
+}
+} // namespace zonciu
+#endif // ZONCIU_PARALLEL_HPP
@@ -0,0 +1,171 @@
+/*
+* Copyright(c) 2016 Zonciu Liang.All rights reserved.
+* Use of this source code is governed by a BSD-style license that can be
+* found in the LICENSE file.
+*
+* Author:  Zonciu Liang
+* Contract: zonciu@zonciu.com
+* Description: sharded timer service
+*/
+
+#ifndef ZONCIU_SHARDED_TIMER_HPP
+#define ZONCIU_SHARDED_TIMER_HPP
+
+#include "zonciu/timer.hpp"
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+namespace zonciu
+{
+/*
+ * N independent MinHeapTimer shards, each with its own heap, observer
+ * and workers.
+ * SetInterval/SetTimeout pick the shard of the calling thread, threads are
+ * spread over the shards round robin. SetIntervalFor/SetTimeoutFor pick it
+ * by a caller supplied key, so related timers share a shard.
+ * timer_id carries the shard in bits 24-31, Remove/Reschedule/Extend go
+ * straight to the owning shard.
+*/
+class ShardedTimer
+{
+public:
+    typedef MinHeapTimer::TimerHandle TimerHandle;
+    typedef MinHeapTimer::TimerId TimerId;
+private:
+    enum
+    {
+        kShardShift = 24,
+        kMaxShards = 256
+    };
+    static_assert(MinHeapTimer::MaxTimers() <= (1u << kShardShift), "timer_id has no room for the shard");
+public:
+    // shard_count = 0: one shard per hardware thread
+    explicit ShardedTimer(unsigned int shard_count = 0, unsigned int workers_per_shard = 1,
+        MinHeapTimer::Dispatch dispatch = MinHeapTimer::Dispatch::any)
+    {
+        if (shard_count == 0)
+            shard_count = std::thread::hardware_concurrency();
+        if (shard_count == 0)
+            shard_count = 1;
+        if (shard_count > kMaxShards)
+            shard_count = kMaxShards;
+        for (unsigned int i = 0; i < shard_count; ++i)
+            _shards.emplace_back(new MinHeapTimer(workers_per_shard, dispatch));
+    }
+    //Wait and run, on the calling thread's shard
+    //Return timer_id
+    template<class _Interval>
+    TimerId SetInterval(_Interval interval, TimerHandle func,
+        std::chrono::microseconds slack = std::chrono::microseconds::zero())
+    {
+        unsigned int shard = ThreadShard();
+        return Encode(shard, _shards[shard]->SetInterval(interval, std::move(func), slack));
+    }
+    template<class _Interval>
+    TimerId SetInterval(_Interval interval, TimerHandle func, MinHeapTimer::IntervalPolicy policy,
+        std::chrono::microseconds slack = std::chrono::microseconds::zero())
+    {
+        unsigned int shard = ThreadShard();
+        return Encode(shard, _shards[shard]->SetInterval(interval, std::move(func), policy, slack));
+    }
+    //Wait and run once, on the calling thread's shard
+    //Return timer_id
+    template<class _Interval>
+    TimerId SetTimeout(_Interval interval, TimerHandle func,
+        std::chrono::microseconds slack = std::chrono::microseconds::zero())
+    {
+        unsigned int shard = ThreadShard();
+        return Encode(shard, _shards[shard]->SetTimeout(interval, std::move(func), slack));
+    }
+    //Same as SetInterval, shard = key % ShardCount()
+    template<class _Interval>
+    TimerId SetIntervalFor(std::size_t key, _Interval interval, TimerHandle func,
+        std::chrono::microseconds slack = std::chrono::microseconds::zero())
+    {
+        unsigned int shard = static_cast<unsigned int>(key % _shards.size());
+        return Encode(shard, _shards[shard]->SetInterval(interval, std::move(func), slack));
+    }
+    template<class _Interval>
+    TimerId SetIntervalFor(std::size_t key, _Interval interval, TimerHandle func, MinHeapTimer::IntervalPolicy policy,
+        std::chrono::microseconds slack = std::chrono::microseconds::zero())
+    {
+        unsigned int shard = static_cast<unsigned int>(key % _shards.size());
+        return Encode(shard, _shards[shard]->SetInterval(interval, std::move(func), policy, slack));
+    }
+    //Same as SetTimeout, shard = key % ShardCount()
+    template<class _Interval>
+    TimerId SetTimeoutFor(std::size_t key, _Interval interval, TimerHandle func,
+        std::chrono::microseconds slack = std::chrono::microseconds::zero())
+    {
+        unsigned int shard = static_cast<unsigned int>(key % _shards.size());
+        return Encode(shard, _shards[shard]->SetTimeout(interval, std::move(func), slack));
+    }
+    //Return false if timer not found
+    bool Remove(TimerId timer_id)
+    {
+        MinHeapTimer* shard = Owner(timer_id);
+        return shard && shard->Remove(Decode(timer_id));
+    }
+    template<class _Delay>
+    bool Reschedule(TimerId timer_id, _Delay delay)
+    {
+        MinHeapTimer* shard = Owner(timer_id);
+        return shard && shard->Reschedule(Decode(timer_id), delay);
+    }
+    template<class _Delta>
+    bool Extend(TimerId timer_id, _Delta delta)
+    {
+        MinHeapTimer* shard = Owner(timer_id);
+        return shard && shard->Extend(Decode(timer_id), delta);
+    }
+    void Clear()
+    {
+        for (auto& shard : _shards)
+            shard->Clear();
+    }
+    //Number of live timers in all shards
+    size_t Size() const
+    {
+        size_t ret = 0;
+        for (auto& shard : _shards)
+            ret += shard->Size();
+        return ret;
+    }
+    size_t ShardCount() const { return _shards.size(); }
+    MinHeapTimer& Shard(size_t index) { return *_shards[index]; }
+private:
+    // Process wide ordinal of the calling thread
+    static unsigned int ThreadOrdinal()
+    {
+        static std::atomic<unsigned int> next(0);
+        static thread_local unsigned int ordinal = next++;
+        return ordinal;
+    }
+    unsigned int ThreadShard() const
+    {
+        return ThreadOrdinal() % static_cast<unsigned int>(_shards.size());
+    }
+    static TimerId Encode(unsigned int shard, TimerId timer_id)
+    {
+        return timer_id | (static_cast<TimerId>(shard) << kShardShift);
+    }
+    static TimerId Decode(TimerId timer_id)
+    {
+        return timer_id & ~(static_cast<TimerId>(kMaxShards - 1) << kShardShift);
+    }
+    MinHeapTimer* Owner(TimerId timer_id)
+    {
+        if (timer_id < 0)
+            return nullptr;
+        std::size_t shard = static_cast<std::size_t>((timer_id >> kShardShift) & (kMaxShards - 1));
+        return shard < _shards.size() ? _shards[shard].get() : nullptr;
+    }
+    ShardedTimer(const ShardedTimer&) = delete;
+    const ShardedTimer& operator=(const ShardedTimer&) = delete;
+    std::vector<std::unique_ptr<MinHeapTimer>> _shards;
+}; // class ShardedTimer
+} // namespace zonciu
+
+#endif // ZONCIU_SHARDED_TIMER_HPP
@@ -0,0 +1,232 @@
+/*
+* Copyright(c) 2016 Zonciu Liang.All rights reserved.
+* Use of this source code is governed by a BSD-style license that can be
+* found in the LICENSE file.
+*
+* Author:  Zonciu Liang
+* Contract: zonciu@zonciu.com
+* Description: task graph scheduler with dependency counting
+*/
+#ifndef ZONCIU_TASK_GRAPH_HPP
+#define ZONCIU_TASK_GRAPH_HPP
+#include "zonciu/assert.hpp"
+#include "zonciu/inplace_function.hpp"
+#include "zonciu/thread_pool.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+namespace zonciu
+{
+/*
+ * Dependency graph of tasks, run on a ThreadPool.
+ * Every node counts its unfinished predecessors; the node finishing last
+ * runs one ready successor itself (continuation stealing) and posts the
+ * rest. Nodes are ThreadPool::Jobs and are posted as they are, so a graph
+ * built once can be Run any number of times without allocating.
+ * A throwing node stops the nodes after it from running; Run rethrows
+ * the first exception once the graph drained.
+ * api:
+ * | Add         - new node, return node id
+ * | Precede     - [before] must finish before [after] starts
+ * | Run         - run the whole graph, block until done
+ * | Timings     - per node start/duration of the last run
+ * | TimingReport
+*/
+class TaskGraph
+{
+public:
+    typedef zonciu::InplaceFunction<void(), 48> Work;
+    typedef std::size_t NodeId;
+    struct NodeTiming
+    {
+        std::string name;
+        std::chrono::nanoseconds start;    // since Run started
+        std::chrono::nanoseconds duration;
+        int worker;                        // pool worker index, -1 = calling thread
+    };
+private:
+    struct Node final : ThreadPool::Job
+    {
+        Node(TaskGraph* _graph, std::size_t _index, Work&& _work, std::string&& _name)
+            :
+            graph(_graph), index(_index), work(std::move(_work)), name(std::move(_name)), predecessors(0),
+            pending(0), start(0), duration(0), worker(-1)
+        {}
+        void Run() override { graph->Execute(this); }
+        TaskGraph* graph;
+        std::size_t index;
+        Work work;
+        std::string name;
+        std::vector<Node*> successors;
+        int predecessors;
+        std::atomic<int> pending;
+        // last run, written by the node's own thread only
+        std::int64_t start;
+        std::int64_t duration;
+        int worker;
+    };
+public:
+    TaskGraph() : _pool(nullptr), _remaining(0), _failed(false), _checked(true) {}
+    NodeId Add(Work work, std::string name = std::string())
+    {
+        ZONCIU_ASSERT(!_pool, "TaskGraph: modified while running");
+        if (name.empty())
+            name = "node" + std::to_string(_nodes.size());
+        _nodes.emplace_back(new Node(this, _nodes.size(), std::move(work), std::move(name)));
+        return _nodes.size() - 1;
+    }
+    void Precede(NodeId before, NodeId after)
+    {
+        ZONCIU_ASSERT(!_pool, "TaskGraph: modified while running");
+        if (before >= _nodes.size() || after >= _nodes.size() || before == after)
+            throw std::invalid_argument("TaskGraph: bad edge");
+        _nodes[before]->successors.push_back(_nodes[after].get());
+        ++_nodes[after]->predecessors;
+        _checked = false;
+    }
+    //Run every node once, dependencies first. The calling thread helps the
+    //pool until the graph is done. Throw std::logic_error on a cycle.
+    void Run(ThreadPool& pool)
+    {
+        ZONCIU_ASSERT(!_pool, "TaskGraph: Run while running");
+        if (_nodes.empty())
+            return;
+        if (!_checked)
+            Check();
+        _pool = &pool;
+        _failed.store(false, std::memory_order_relaxed);
+        _error = nullptr;
+        _remaining.store(_nodes.size(), std::memory_order_relaxed);
+        for (auto& node : _nodes)
+            node->pending.store(node->predecessors, std::memory_order_relaxed);
+        _start = std::chrono::steady_clock::now();
+        for (auto& node : _nodes)
+        {
+            if (!node->predecessors)
+                Spawn(node.get());
+        }
+        while (_remaining.load(std::memory_order_acquire) != 0)
+        {
+            if (!pool.TryRunOne())
+                std::this_thread::yield();
+        }
+        _pool = nullptr;
+        if (_error)
+            std::rethrow_exception(_error);
+    }
+    size_t Size() const { return _nodes.size(); }
+    std::vector<NodeTiming> Timings() const
+    {
+        std::vector<NodeTiming> ret;
+        ret.reserve(_nodes.size());
+        for (auto& node : _nodes)
+        {
+            NodeTiming timing;
+            timing.name = node->name;
+            timing.start = std::chrono::nanoseconds(node->start);
+            timing.duration = std::chrono::nanoseconds(node->duration);
+            timing.worker = node->worker;
+            ret.push_back(timing);
+        }
+        return ret;
+    }
+    //One line per node: name, worker, start and duration in microseconds
+    std::string TimingReport() const
+    {
+        std::string ret;
+        char line[160];
+        for (auto& node : _nodes)
+        {
+            std::snprintf(line, sizeof(line), "%-24s worker %3d start %10.1fus took %10.1fus\n",
+                node->name.c_str(), node->worker, node->start / 1000.0, node->duration / 1000.0);
+            ret += line;
+        }
+        return ret;
+    }
+private:
+    // Kahn's algorithm on a copy of the counters
+    void Check()
+    {
+        std::vector<int> pending(_nodes.size());
+        std::vector<Node*> ready;
+        for (std::size_t i = 0; i < _nodes.size(); ++i)
+        {
+            pending[i] = _nodes[i]->predecessors;
+            if (!pending[i])
+                ready.push_back(_nodes[i].get());
+        }
+        std::size_t seen = 0;
+        while (!ready.empty())
+        {
+            Node* node = ready.back();
+            ready.pop_back();
+            ++seen;
+            for (Node* next : node->successors)
+            {
+                if (!--pending[next->index])
+                    ready.push_back(next);
+            }
+        }
+        if (seen != _nodes.size())
+            throw std::logic_error("TaskGraph: cycle");
+        _checked = true;
+    }
+    void Spawn(Node* node)
+    {
+        _pool->PostJob(node);
+    }
+    void Execute(Node* node)
+    {
+        using namespace std::chrono;
+        while (node)
+        {
+            auto begin = steady_clock::now();
+            if (!_failed.load(std::memory_order_relaxed))
+            {
+                try
+                {
+                    node->work();
+                }
+                catch (...)
+                {
+                    if (!_failed.exchange(true))
+                        _error = std::current_exception();
+                }
+            }
+            auto end = steady_clock::now();
+            node->start = duration_cast<nanoseconds>(begin - _start).count();
+            node->duration = duration_cast<nanoseconds>(end - begin).count();
+            node->worker = _pool->WorkerIndex();
+            // keep the first ready successor, hand the others to the pool
+            Node* next = nullptr;
+            for (Node* successor : node->successors)
+            {
+                if (successor->pending.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                    continue;
+                if (!next)
+                    next = successor;
+                else
+                    Spawn(successor);
+            }
+            _remaining.fetch_sub(1, std::memory_order_release);
+            node = next;
+        }
+    }
+    TaskGraph(const TaskGraph&) = delete;
+    TaskGraph& operator=(const TaskGraph&) = delete;
+    std::vector<std::unique_ptr<Node>> _nodes;
+    ThreadPool* _pool;
+    std::atomic<std::size_t> _remaining;
+    std::atomic<bool> _failed;
+    std::exception_ptr _error;
+    std::chrono::steady_clock::time_point _start;
+    bool _checked;
+}; // class TaskGraph
+} // namespace zonciu
+#endif // ZONCIU_TASK_GRAPH_HPP
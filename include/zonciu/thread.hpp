@@ -2,29 +2,176 @@
 #define ZONCIU_THREAD_HPP
 #include "zonciu/lock.hpp"
 #include "zonciu/assert.hpp"
+#include "zonciu/cpu.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
 #include <thread>
-#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#if defined(__linux__)
+#include <pthread.h>
+#include <time.h>
+#endif
 namespace zonciu
 {
-class ThreadGroup
+namespace detail
+{
+struct StopState
+{
+    StopState() : stopped(false) {}
+    std::atomic<bool> stopped;
+    std::mutex mutex;
+    std::condition_variable cv;
+};
+} // namespace detail
+//Read side of a stop request, cheap to copy
+class StopToken
 {
 public:
-    ThreadGroup() {}
-    ~ThreadGroup()
+    StopToken() {}
+    explicit StopToken(std::shared_ptr<detail::StopState> state) : _state(std::move(state)) {}
+    bool StopRequested() const
     {
-        for (auto it = _group.begin(); it != _group.end(); ++it)
+        return _state && _state->stopped.load(std::memory_order_acquire);
+    }
+    //Sleep up to [duration], wake early on stop
+    //Return false if stop was requested
+    template<class _Rep, class _Period>
+    bool SleepFor(std::chrono::duration<_Rep, _Period> duration) const
+    {
+        if (!_state)
         {
-            delete *it;
+            std::this_thread::sleep_for(duration);
+            return true;
         }
+        std::unique_lock<std::mutex> lck(_state->mutex);
+        return !_state->cv.wait_for(lck, duration, [this]() { return StopRequested(); });
+    }
+private:
+    std::shared_ptr<detail::StopState> _state;
+};
+//Write side of a stop request
+class StopSource
+{
+public:
+    StopSource() : _state(std::make_shared<detail::StopState>()) {}
+    //Return false if stop was already requested
+    bool RequestStop()
+    {
+        if (_state->stopped.exchange(true, std::memory_order_acq_rel))
+            return false;
+        std::lock_guard<std::mutex> lck(_state->mutex);
+        _state->cv.notify_all();
+        return true;
+    }
+    bool StopRequested() const { return _state->stopped.load(std::memory_order_acquire); }
+    StopToken GetToken() const { return StopToken(_state); }
+private:
+    std::shared_ptr<detail::StopState> _state;
+};
+//One thread of a ThreadGroup at the time of ThreadGroup::Stats
+struct ThreadStats
+{
+    std::thread::id id;
+    long tid;                           // kernel thread id, 0 for threads from Add
+    std::chrono::nanoseconds cpu_time;  // user + system, 0 if unknown
+    long long voluntary_switches;       // blocked/slept, -1 if unknown
+    long long involuntary_switches;     // preempted, -1 if unknown
+    int cpu;                            // cpu it last ran on, -1 if unknown
+};
+/*
+ * Owns a set of threads, keyed by thread id, lookups are O(1).
+ * Threads created here may take a StopToken and poll it, RequestStop asks
+ * all of them to finish; they also report their exit, so JoinAll can give
+ * up at a deadline.
+ * The destructor requests stop and joins whatever is left.
+ * api:
+ * | Create / CreateWorkers - start threads, func() or func(StopToken)
+ * | Add / Remove           - adopt or forget a std::thread
+ * | Join / JoinAll         - JoinAll(deadline) joins what exits in time
+ * | RequestStop / GetStopToken
+ * | Stats                  - cpu time, context switches and cpu per thread
+*/
+class ThreadGroup
+{
+    struct Exit
+    {
+        Exit() : done(false), tid(0) {}
+        std::atomic<bool> done;
+        std::atomic<long> tid;
+    };
+    // shared with the threads, which may outlive a forgotten entry
+    struct Shared
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+    struct Entry
+    {
+        std::thread* thread;
+        // nullptr for threads from Add, their exit is not observable
+        std::shared_ptr<Exit> exit;
+    };
+public:
+    ThreadGroup() : _shared(std::make_shared<Shared>()) {}
+    ~ThreadGroup()
+    {
+        RequestStop();
+        JoinAll();
     }
+    //func_() or func_(StopToken)
     template<typename _Func>
     std::thread* Create(_Func func_)
     {
+        std::shared_ptr<Exit> exit = std::make_shared<Exit>();
+        std::shared_ptr<Shared> shared = _shared;
+        StopToken token = _stop.GetToken();
         zonciu::RecursiveSpinGuard sg(_lock);
-        std::thread* thread = new std::thread(func_);
-        _group.push_back(thread);
+        std::thread* thread = new std::thread([func_, exit, shared, token]() mutable
+        {
+            exit->tid.store(zonciu::cpu::ThreadId(), std::memory_order_relaxed);
+            Call(func_, token, 0);
+            std::lock_guard<std::mutex> lck(shared->mutex);
+            exit->done.store(true, std::memory_order_release);
+            shared->cv.notify_all();
+        });
+        Entry entry = { thread, exit };
+        _group[thread->get_id()] = entry;
         return thread;
     }
+    //Start a thread with affinity/name from [options], set before func_ runs
+    template<typename _Func>
+    std::thread* Create(_Func func_, const ThreadOptions& options)
+    {
+        return Create([func_, options](const StopToken& token) mutable
+        {
+            zonciu::cpu::Apply(options);
+            Call(func_, token, 0);
+        });
+    }
+    //Start [count] threads laid out by [placement] over the sysfs topology,
+    //named "[name]-index". func_ gets the thread index.
+    template<typename _Func>
+    std::vector<std::thread*> CreateWorkers(std::size_t count, Placement placement, const std::string& name,
+        _Func func_)
+    {
+        std::vector<std::vector<int>> layout = CpuTopology::Get().Layout(placement, count);
+        std::vector<std::thread*> ret;
+        ret.reserve(count);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            ThreadOptions options(layout[i], name.empty() ? name : name + "-" + std::to_string(i));
+            ret.push_back(Create([func_, i]() mutable { func_(i); }, options));
+        }
+        return ret;
+    }
 
     void Add(std::thread* thread_)
     {
@@ -32,94 +179,240 @@ public:
         {
             ZONCIU_ASSERT(!IsContainThread(thread_), "This thread is in this group");
             zonciu::RecursiveSpinGuard sg(_lock);
-            _group.push_back(thread_);
+            Entry entry = { thread_, nullptr };
+            _group[thread_->get_id()] = entry;
         }
     }
+    //Forget and delete [thread_], a running thread is detached first
     void Remove(std::thread* thread_)
     {
         if (thread_)
         {
-            std::thread::id id = thread_->get_id();
             zonciu::RecursiveSpinGuard sg(_lock);
-            for (auto it = _group.begin(); it != _group.end(); ++it)
-            {
-                if ((*it)->get_id() == id)
-                {
-                    delete *it;
-                    _group.erase(it);
-                    return;
-                }
-            }
+            auto it = _group.find(thread_->get_id());
+            if (it == _group.end())
+                return;
+            if (it->second.thread->joinable())
+                it->second.thread->detach();
+            delete it->second.thread;
+            _group.erase(it);
         }
     }
     bool IsContainThread(std::thread* thread_)
     {
         if (thread_)
         {
-            std::thread::id id = thread_->get_id();
             zonciu::RecursiveSpinGuard sg(_lock);
-            for (auto&it : _group)
-            {
-                if (it->get_id() == id)
-                    return true;
-            }
+            return _group.count(thread_->get_id()) != 0;
         }
         return false;
     }
 
     bool IsContainThisThread()
     {
-        std::thread::id id = std::this_thread::get_id();
         zonciu::RecursiveSpinGuard sg(_lock);
-        for (auto&it : _group)
-        {
-            if (it->get_id() == id)
-                return true;
-        }
-        return false;
+        return _group.count(std::this_thread::get_id()) != 0;
     }
 
     void JoinAll()
     {
-        zonciu::RecursiveSpinGuard sg(_lock);
-        for (auto it = _group.begin(); it != _group.end();)
+        std::unordered_map<std::thread::id, Entry> group;
+        {
+            zonciu::RecursiveSpinGuard sg(_lock);
+            group.swap(_group);
+        }
+        // join without the lock, exiting threads may still query the group
+        for (auto& it : group)
         {
-            (*it)->join();
-            delete *it;
-            it = _group.erase(it);
+            if (it.second.thread->joinable())
+                it.second.thread->join();
+            delete it.second.thread;
         }
     }
+    //Join every thread that exits before [deadline], the rest stay in the group.
+    //Threads from Add always stay, their exit is not observable.
+    //Return true if the group is empty
+    bool JoinAll(std::chrono::steady_clock::time_point deadline)
+    {
+        for (;;)
+        {
+            std::vector<std::thread*> done;
+            bool waiting = false;
+            {
+                zonciu::RecursiveSpinGuard sg(_lock);
+                for (auto it = _group.begin(); it != _group.end();)
+                {
+                    if (it->second.exit && it->second.exit->done.load(std::memory_order_acquire))
+                    {
+                        done.push_back(it->second.thread);
+                        it = _group.erase(it);
+                        continue;
+                    }
+                    waiting = waiting || it->second.exit;
+                    ++it;
+                }
+            }
+            for (auto thread : done)
+            {
+                thread->join();
+                delete thread;
+            }
+            if (!waiting || std::chrono::steady_clock::now() >= deadline)
+                break;
+            std::unique_lock<std::mutex> lck(_shared->mutex);
+            // re-checked under the mutex the exiting thread notifies with
+            if (!AnyDone())
+                _shared->cv.wait_until(lck, deadline);
+        }
+        return Size() == 0;
+    }
+    template<class _Rep, class _Period>
+    bool JoinFor(std::chrono::duration<_Rep, _Period> timeout)
+    {
+        return JoinAll(std::chrono::steady_clock::now() + timeout);
+    }
 
     bool Join(std::thread* thread_)
     {
         if (thread_)
         {
-            std::thread::id id = thread_->get_id();
-            zonciu::RecursiveSpinGuard sg(_lock);
-            for (auto it = _group.begin(); it != _group.end();)
+            std::thread* thread = nullptr;
             {
-                if ((*it)->get_id() == id)
-                {
-                    (*it)->join();
-                    delete *it;
-                    it = _group.erase(it);
-                    return true;
-                }
+                zonciu::RecursiveSpinGuard sg(_lock);
+                auto it = _group.find(thread_->get_id());
+                if (it == _group.end())
+                    return false;
+                thread = it->second.thread;
+                _group.erase(it);
             }
+            if (thread->joinable())
+                thread->join();
+            delete thread;
+            return true;
         }
         return false;
     }
+    //Ask every thread holding this group's StopToken to finish
+    void RequestStop() { _stop.RequestStop(); }
+    bool StopRequested() const { return _stop.StopRequested(); }
+    StopToken GetStopToken() const { return _stop.GetToken(); }
 
     size_t Size()
     {
         zonciu::RecursiveSpinGuard sg(_lock);
         return _group.size();
     }
+    //Sample every thread: cpu time from its pthread cpu clock, context
+    //switches and last cpu from /proc/self/task. Diff two snapshots to
+    //find hot (cpu time ~ wall time) or starved (many involuntary
+    //switches) threads. Linux only, elsewhere the fields stay unknown.
+    //The lock is only held to copy ids and clocks, reads happen outside.
+    std::vector<ThreadStats> Stats()
+    {
+        std::vector<ThreadStats> ret;
+#if defined(__linux__)
+        // cpu clock of each entry, -1 when it has none
+        std::vector<clockid_t> clocks;
+#endif
+        {
+            zonciu::RecursiveSpinGuard sg(_lock);
+            ret.reserve(_group.size());
+#if defined(__linux__)
+            clocks.reserve(_group.size());
+#endif
+            for (auto& it : _group)
+            {
+                ThreadStats stats;
+                stats.id = it.first;
+                stats.tid = it.second.exit ? it.second.exit->tid.load(std::memory_order_relaxed) : 0;
+                stats.cpu_time = std::chrono::nanoseconds(0);
+                stats.voluntary_switches = -1;
+                stats.involuntary_switches = -1;
+                stats.cpu = -1;
+                ret.push_back(stats);
+#if defined(__linux__)
+                // the handle is only valid while the thread is not joined or
+                // detached, which the lock guarantees; the clock id survives
+                // it, clock_gettime fails once the thread is gone
+                clockid_t clock = static_cast<clockid_t>(-1);
+                std::thread* thread = it.second.thread;
+                if (!thread->joinable() || thread->native_handle() == 0
+                    || pthread_getcpuclockid(thread->native_handle(), &clock) != 0)
+                {
+                    clock = static_cast<clockid_t>(-1);
+                }
+                clocks.push_back(clock);
+#endif
+            }
+        }
+#if defined(__linux__)
+        for (std::size_t i = 0; i < ret.size(); ++i)
+        {
+            timespec ts;
+            if (clocks[i] != static_cast<clockid_t>(-1) && clock_gettime(clocks[i], &ts) == 0)
+                ret[i].cpu_time = std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+            if (ret[i].tid)
+                ReadProc(ret[i]);
+        }
+#endif
+        return ret;
+    }
 private:
+    static void ReadProc(ThreadStats& stats)
+    {
+        std::string base = "/proc/self/task/" + std::to_string(stats.tid) + "/";
+        std::ifstream status((base + "status").c_str());
+        std::string line;
+        while (std::getline(status, line))
+        {
+            if (line.compare(0, 24, "voluntary_ctxt_switches:") == 0)
+                stats.voluntary_switches = std::atoll(line.c_str() + 24);
+            else if (line.compare(0, 27, "nonvoluntary_ctxt_switches:") == 0)
+                stats.involuntary_switches = std::atoll(line.c_str() + 27);
+        }
+        std::ifstream stat((base + "stat").c_str());
+        if (!std::getline(stat, line))
+            return;
+        // the name in () may hold spaces, fields count from after it;
+        // the state right after the name is field 3, processor is field 39
+        std::size_t pos = line.rfind(')');
+        if (pos == std::string::npos)
+            return;
+        const char* p = line.c_str() + pos + 1;
+        for (int field = 3; field < 39 && *p; ++field)
+        {
+            p = std::strchr(p + 1, ' ');
+            if (!p)
+                return;
+        }
+        stats.cpu = std::atoi(p);
+    }
+    template<typename _Func>
+    static auto Call(_Func& func_, const StopToken& token, int) -> decltype(func_(token), void())
+    {
+        func_(token);
+    }
+    template<typename _Func>
+    static void Call(_Func& func_, const StopToken&, long)
+    {
+        func_();
+    }
+    bool AnyDone()
+    {
+        zonciu::RecursiveSpinGuard sg(_lock);
+        for (auto& it : _group)
+        {
+            if (it.second.exit && it.second.exit->done.load(std::memory_order_acquire))
+                return true;
+        }
+        return false;
+    }
     ThreadGroup(const ThreadGroup&) = delete;
     const ThreadGroup& operator=(const ThreadGroup&) = delete;
-    std::list<std::thread*> _group;
+    std::unordered_map<std::thread::id, Entry> _group;
     mutable zonciu::RecursiveSpinLock _lock;
+    std::shared_ptr<Shared> _shared;
+    StopSource _stop;
 };
 }
 #endif
@@ -0,0 +1,469 @@
+/*
+* Copyright(c) 2016 Zonciu Liang.All rights reserved.
+* Use of this source code is governed by a BSD-style license that can be
+* found in the LICENSE file.
+*
+* Author:  Zonciu Liang
+* Contract: zonciu@zonciu.com
+* Description: work-stealing thread pool
+*/
+#ifndef ZONCIU_THREAD_POOL_HPP
+#define ZONCIU_THREAD_POOL_HPP
+#include "zonciu/3rd/concurrentqueue/concurrentqueue.h"
+#include "zonciu/inplace_function.hpp"
+#include "zonciu/lock.hpp"
+#include "zonciu/semaphor.hpp"
+#include "zonciu/thread.hpp"
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+namespace zonciu
+{
+namespace detail
+{
+/*
+ * Chase-Lev work-stealing deque (Le, Pop, Cohen, Nardelli 2013).
+ * The owner pushes and pops at the bottom, thieves steal from the top.
+ * Only the owner grows the buffer; old buffers are kept until the deque
+ * dies because a thief may still read them.
+*/
+template<class T>
+class WorkStealingDeque
+{
+    struct Buffer
+    {
+        explicit Buffer(std::int64_t _capacity)
+            :
+            capacity(_capacity), mask(_capacity - 1), slots(new std::atomic<T>[_capacity])
+        {}
+        // acquire/release on slots is free on x86 and keeps race checkers quiet about the fences
+        T Get(std::int64_t index) const { return slots[index & mask].load(std::memory_order_acquire); }
+        void Put(std::int64_t index, T value) { slots[index & mask].store(value, std::memory_order_release); }
+        const std::int64_t capacity;
+        const std::int64_t mask;
+        std::unique_ptr<std::atomic<T>[]> slots;
+    };
+public:
+    // capacity: rounded up to a power of 2
+    explicit WorkStealingDeque(std::int64_t capacity = 256) : _top(0), _bottom(0)
+    {
+        std::int64_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        _buffers.emplace_back(new Buffer(size));
+        _buffer.store(_buffers.back().get(), std::memory_order_relaxed);
+    }
+    // owner only
+    void Push(T value)
+    {
+        std::int64_t bottom = _bottom.load(std::memory_order_relaxed);
+        std::int64_t top = _top.load(std::memory_order_acquire);
+        Buffer* buffer = _buffer.load(std::memory_order_relaxed);
+        if (bottom - top > buffer->capacity - 1)
+            buffer = Grow(buffer, top, bottom);
+        buffer->Put(bottom, value);
+        _bottom.store(bottom + 1, std::memory_order_release);
+    }
+    // owner only
+    bool Pop(T& value)
+    {
+        std::int64_t bottom = _bottom.load(std::memory_order_relaxed) - 1;
+        Buffer* buffer = _buffer.load(std::memory_order_relaxed);
+        _bottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t top = _top.load(std::memory_order_relaxed);
+        if (top > bottom)
+        {
+            _bottom.store(bottom + 1, std::memory_order_relaxed);
+            return false;
+        }
+        value = buffer->Get(bottom);
+        if (top == bottom)
+        {
+            // last item, race the thieves for it
+            bool won = _top.compare_exchange_strong(top, top + 1,
+                std::memory_order_seq_cst, std::memory_order_relaxed);
+            _bottom.store(bottom + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+    // any thread
+    bool Steal(T& value)
+    {
+        std::int64_t top = _top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t bottom = _bottom.load(std::memory_order_acquire);
+        if (top >= bottom)
+            return false;
+        Buffer* buffer = _buffer.load(std::memory_order_acquire);
+        T tmp = buffer->Get(top);
+        if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return false;
+        value = tmp;
+        return true;
+    }
+    bool Empty() const
+    {
+        return _bottom.load(std::memory_order_relaxed) <= _top.load(std::memory_order_relaxed);
+    }
+private:
+    Buffer* Grow(Buffer* old, std::int64_t top, std::int64_t bottom)
+    {
+        Buffer* fresh = new Buffer(old->capacity * 2);
+        for (std::int64_t i = top; i < bottom; ++i)
+            fresh->Put(i, old->Get(i));
+        _buffers.emplace_back(fresh);
+        _buffer.store(fresh, std::memory_order_release);
+        return fresh;
+    }
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+    // top and bottom on their own cache lines, thieves hammer top.
+    // Padding instead of alignas, C++11 new ignores extended alignment.
+    char _pad0[64];
+    std::atomic<std::int64_t> _top;
+    char _pad1[64 - sizeof(std::atomic<std::int64_t>)];
+    std::atomic<std::int64_t> _bottom;
+    char _pad2[64 - sizeof(std::atomic<std::int64_t>)];
+    std::atomic<Buffer*> _buffer;
+    std::vector<std::unique_ptr<Buffer>> _buffers;
+};
+/*
+ * Run queues shared by ThreadPool and FiberScheduler: one Chase-Lev deque
+ * per worker, an injection queue for other threads, random-victim
+ * stealing and parking on a Semaphore.
+ * Lost wakeups: Push publishes the item, fences, then checks for sleepers;
+ * Park announces the sleeper, fences, then checks for work. Either the
+ * pusher sees the sleeper or the sleeper sees the item.
+*/
+template<class T>
+class WorkQueues
+{
+    struct Worker
+    {
+        Worker() : rng(0), tick(0) {}
+        WorkStealingDeque<T> deque;
+        std::uint32_t rng;
+        std::uint32_t tick;
+    };
+public:
+    explicit WorkQueues(std::size_t count) : _stop(false), _sleeping(0)
+    {
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            _workers.emplace_back(new Worker);
+            _workers.back()->rng = 0x9e3779b9u * static_cast<std::uint32_t>(i + 1);
+        }
+    }
+    //index: the calling worker, -1 for other threads
+    void Push(int index, T item)
+    {
+        if (index >= 0)
+            _workers[index]->deque.Push(item);
+        else
+            _injection.enqueue(item);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_sleeping.load(std::memory_order_relaxed) > 0)
+            _parking.Signal();
+    }
+    //Own deque, then the injection queue, then a random victim.
+    //Every 61st call a worker takes the injection queue and its own oldest
+    //item first, so a pair of items re-pushing each other can't starve them.
+    bool Find(int index, T& item)
+    {
+        if (index >= 0 && ++_workers[index]->tick % 61 == 0)
+        {
+            if (_injection.try_dequeue(item) || _workers[index]->deque.Steal(item))
+                return true;
+        }
+        if (index >= 0 && _workers[index]->deque.Pop(item))
+            return true;
+        if (_injection.try_dequeue(item))
+            return true;
+        std::size_t count = _workers.size();
+        std::size_t start = index >= 0 ? NextRandom(*_workers[index]) % count : 0;
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            std::size_t victim = (start + i) % count;
+            if (static_cast<int>(victim) != index && _workers[victim]->deque.Steal(item))
+                return true;
+        }
+        return false;
+    }
+    bool HasWork() const
+    {
+        if (_injection.size_approx() != 0)
+            return true;
+        for (auto& worker : _workers)
+        {
+            if (!worker->deque.Empty())
+                return true;
+        }
+        return false;
+    }
+    //Call when Find came back empty: brief spin, fine-grained work arrives
+    //in bursts, then park until Push or Stop
+    void Idle(int& idle)
+    {
+        if (++idle < 64)
+        {
+            zonciu::CpuRelax();
+            return;
+        }
+        idle = 0;
+        _sleeping.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!HasWork() && !_stop.load(std::memory_order_relaxed))
+            _parking.Wait();
+        _sleeping.fetch_sub(1, std::memory_order_relaxed);
+    }
+    //Wake every worker, they leave once Stopped and nothing is queued
+    void Stop()
+    {
+        _stop.store(true, std::memory_order_seq_cst);
+        _parking.Signal(static_cast<int>(_workers.size()));
+    }
+    bool Stopped() const { return _stop.load(std::memory_order_acquire); }
+    std::size_t Count() const { return _workers.size(); }
+private:
+    static std::uint32_t NextRandom(Worker& worker)
+    {
+        // xorshift32
+        std::uint32_t x = worker.rng;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        worker.rng = x;
+        return x;
+    }
+    WorkQueues(const WorkQueues&) = delete;
+    WorkQueues& operator=(const WorkQueues&) = delete;
+    std::atomic<bool> _stop;
+    std::atomic<int> _sleeping;
+    zonciu::Semaphore _parking;
+    moodycamel::ConcurrentQueue<T> _injection;
+    std::vector<std::unique_ptr<Worker>> _workers;
+};
+} // namespace detail
+
+/*
+ * Work-stealing thread pool on ThreadGroup.
+ * Every worker owns a Chase-Lev deque; tasks posted from a worker go to
+ * its own deque (LIFO, cache friendly), tasks from other threads go to a
+ * shared injection queue. Idle workers steal from random victims, then
+ * park on a Semaphore.
+ * Task nodes are recycled through per-worker free lists that spill into
+ * a shared lock-free list, so a steady stream of Posts does not allocate.
+ * Tasks still queued at destruction are run before the workers exit.
+ * api:
+ * | Post        - run func, no result, func must not throw
+ * | PostJob     - queue a caller-owned Job, never allocates
+ * | Submit      - run func, return std::future
+ * | TryRunOne   - run one queued task on the calling thread
+ * | WorkerIndex - index of the calling worker, -1 for other threads
+*/
+class ThreadPool
+{
+public:
+    typedef zonciu::InplaceFunction<void(), 48> Task;
+    //Intrusive unit of work for PostJob. The pool never owns or frees it;
+    //it must stay alive until Run returns and may be posted again after.
+    class Job
+    {
+    public:
+        virtual void Run() = 0;
+    protected:
+        ~Job() {}
+    };
+private:
+    // worker free list length, half of it spills to _spare beyond that
+    enum { kCacheSize = 256 };
+    struct TaskNode final : Job
+    {
+        explicit TaskNode(ThreadPool* _pool) : pool(_pool) {}
+        void Run() override
+        {
+            func();
+            func.Reset();
+            pool->Recycle(this);
+        }
+        Task func;
+        ThreadPool* pool;
+    };
+    struct Worker
+    {
+        Worker() { cache.reserve(kCacheSize + 1); }
+        // recycled nodes, owner only
+        std::vector<TaskNode*> cache;
+    };
+    struct Current
+    {
+        ThreadPool* pool;
+        int index;
+    };
+public:
+    //thread_count: 0 = hardware_concurrency
+    //placement/name: worker affinity and thread names, see ThreadGroup::CreateWorkers
+    explicit ThreadPool(unsigned int thread_count = 0, Placement placement = Placement::none,
+        const std::string& name = std::string())
+        :
+        _queues(ThreadCount(thread_count))
+    {
+        thread_count = static_cast<unsigned int>(_queues.Count());
+        for (unsigned int i = 0; i < thread_count; ++i)
+            _workers.emplace_back(new Worker);
+        _threads.CreateWorkers(thread_count, placement, name,
+            [this](std::size_t i) { Run(static_cast<int>(i)); });
+    }
+    ~ThreadPool()
+    {
+        _queues.Stop();
+        _threads.JoinAll();
+        // nothing is left, workers drain before exit, every node is back
+        for (auto& worker : _workers)
+        {
+            for (auto node : worker->cache)
+                delete node;
+        }
+        TaskNode* node = nullptr;
+        while (_spare.try_dequeue(node))
+            delete node;
+    }
+    template<class _Func>
+    void Post(_Func&& func)
+    {
+        Push(NewTask(Task(std::forward<_Func>(func))));
+    }
+    void PostJob(Job* job)
+    {
+        Push(job);
+    }
+    template<class _Func>
+    std::future<decltype(std::declval<typename std::decay<_Func>::type&>()())> Submit(_Func&& func)
+    {
+        typedef decltype(std::declval<typename std::decay<_Func>::type&>()()) Result;
+        std::packaged_task<Result()> task(std::forward<_Func>(func));
+        std::future<Result> ret = task.get_future();
+        Push(NewTask(Task(std::move(task))));
+        return ret;
+    }
+    //Run one queued task here, for threads waiting on pool work
+    //Return false if nothing was found
+    bool TryRunOne()
+    {
+        const Current& current = CurrentWorker();
+        int index = current.pool == this ? current.index : -1;
+        Job* job = nullptr;
+        if (!_queues.Find(index, job))
+            return false;
+        job->Run();
+        return true;
+    }
+    //Index of the calling worker in this pool, -1 for other threads
+    int WorkerIndex() const
+    {
+        const Current& current = CurrentWorker();
+        return current.pool == this ? current.index : -1;
+    }
+    size_t WorkerCount() const { return _workers.size(); }
+private:
+    static std::size_t ThreadCount(unsigned int thread_count)
+    {
+        if (thread_count == 0)
+            thread_count = std::thread::hardware_concurrency();
+        return thread_count == 0 ? 1 : thread_count;
+    }
+    static Current& CurrentWorker()
+    {
+        static thread_local Current current = { nullptr, -1 };
+        return current;
+    }
+    TaskNode* NewTask(Task&& func)
+    {
+        TaskNode* node = nullptr;
+        const Current& current = CurrentWorker();
+        if (current.pool == this)
+        {
+            std::vector<TaskNode*>& cache = _workers[current.index]->cache;
+            if (cache.empty())
+            {
+                TaskNode* batch[kCacheSize / 4];
+                std::size_t count = _spare.try_dequeue_bulk(batch, kCacheSize / 4);
+                cache.insert(cache.end(), batch, batch + count);
+            }
+            if (!cache.empty())
+            {
+                node = cache.back();
+                cache.pop_back();
+            }
+        }
+        else
+        {
+            _spare.try_dequeue(node);
+        }
+        if (!node)
+            node = new TaskNode(this);
+        node->func = std::move(func);
+        return node;
+    }
+    // nodes run by thieves pile up in their caches, spill half to _spare
+    void Recycle(TaskNode* node)
+    {
+        const Current& current = CurrentWorker();
+        if (current.pool != this)
+        {
+            _spare.enqueue(node);
+            return;
+        }
+        std::vector<TaskNode*>& cache = _workers[current.index]->cache;
+        if (cache.size() >= kCacheSize)
+        {
+            _spare.enqueue_bulk(cache.begin() + kCacheSize / 2, kCacheSize / 2);
+            cache.resize(kCacheSize / 2);
+        }
+        cache.push_back(node);
+    }
+    void Push(Job* job)
+    {
+        const Current& current = CurrentWorker();
+        _queues.Push(current.pool == this ? current.index : -1, job);
+    }
+    void Run(int index)
+    {
+        Current& current = CurrentWorker();
+        current.pool = this;
+        current.index = index;
+        int idle = 0;
+        for (;;)
+        {
+            Job* job = nullptr;
+            if (_queues.Find(index, job))
+            {
+                job->Run();
+                idle = 0;
+                continue;
+            }
+            if (_queues.Stopped() && !_queues.HasWork())
+                break;
+            _queues.Idle(idle);
+        }
+        current.pool = nullptr;
+        current.index = -1;
+    }
+    ThreadPool(const ThreadPool&) = delete;
+    const ThreadPool& operator=(const ThreadPool&) = delete;
+    detail::WorkQueues<Job*> _queues;
+    // recycled nodes shared by all threads
+    moodycamel::ConcurrentQueue<TaskNode*> _spare;
+    std::vector<std::unique_ptr<Worker>> _workers;
+    zonciu::ThreadGroup _threads;
+}; // class ThreadPool
+} // namespace zonciu
+#endif // ZONCIU_THREAD_POOL_HPP
@@ -11,231 +11,1402 @@
 #define ZONCIU_TIMER_HPP
 
 #include "zonciu/3rd/concurrentqueue/blockingconcurrentqueue.h"
+#include "zonciu/histogram.hpp"
+#include "zonciu/inplace_function.hpp"
 #include "zonciu/lock.hpp"
 #include "zonciu/semaphor.hpp"
 #include <stdint.h>
-#include <functional>
+#include <chrono>
 #include <atomic>
-#include <map>
-#include <queue>
+#include <functional>
+#include <memory>
+#include <stdexcept>
 #include <vector>
+#if defined(__linux__)
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
 namespace zonciu
 {
+namespace detail
+{
+#if defined(__linux__)
+/*
+ * Observer sleep on Linux: epoll over a timerfd armed with an absolute
+ * CLOCK_MONOTONIC deadline (same clock as std::chrono::steady_clock)
+ * and an eventfd for Signal. The timerfd is re-armed only when the
+ * deadline changes.
+*/
+class DeadlineWaiter
+{
+public:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+    DeadlineWaiter() : _armed(TimePoint::max())
+    {
+        _epoll = epoll_create1(EPOLL_CLOEXEC);
+        _timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        _event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (_epoll < 0 || _timer < 0 || _event < 0)
+        {
+            Close();
+            throw std::runtime_error("DeadlineWaiter: create fd failed");
+        }
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = _timer;
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, _timer, &ev);
+        ev.data.fd = _event;
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, _event, &ev);
+    }
+    ~DeadlineWaiter() { Close(); }
+    void Signal()
+    {
+        std::uint64_t one = 1;
+        ssize_t rc = write(_event, &one, sizeof(one));
+        (void)rc;
+    }
+    //Block until Signal or deadline, TimePoint::max() = no deadline
+    void WaitUntil(TimePoint deadline)
+    {
+        if (deadline != _armed)
+            Arm(deadline);
+        epoll_event events[2];
+        int count;
+        do
+        {
+            count = epoll_wait(_epoll, events, 2, -1);
+        } while (count == -1 && errno == EINTR);
+        for (int i = 0; i < count; ++i)
+        {
+            std::uint64_t value;
+            ssize_t rc = read(events[i].data.fd, &value, sizeof(value));
+            (void)rc;
+            // one-shot timer is disarmed once it fired
+            if (events[i].data.fd == _timer)
+                _armed = TimePoint::max();
+        }
+    }
+private:
+    void Arm(TimePoint deadline)
+    {
+        using namespace std::chrono;
+        itimerspec spec = {};
+        if (deadline != TimePoint::max())
+        {
+            auto ns = duration_cast<nanoseconds>(deadline.time_since_epoch()).count();
+            // zero it_value disarms the timer
+            if (ns <= 0)
+                ns = 1;
+            spec.it_value.tv_sec = static_cast<time_t>(ns / 1000000000);
+            spec.it_value.tv_nsec = static_cast<long>(ns % 1000000000);
+        }
+        timerfd_settime(_timer, TFD_TIMER_ABSTIME, &spec, nullptr);
+        _armed = deadline;
+    }
+    void Close()
+    {
+        if (_epoll >= 0) close(_epoll);
+        if (_timer >= 0) close(_timer);
+        if (_event >= 0) close(_event);
+    }
+    DeadlineWaiter(const DeadlineWaiter&) = delete;
+    DeadlineWaiter& operator=(const DeadlineWaiter&) = delete;
+    int _epoll;
+    int _timer;
+    int _event;
+    TimePoint _armed;
+};
+#else
+class DeadlineWaiter
+{
+public:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+    void Signal() { _sema.Signal(); }
+    //Block until Signal or deadline, TimePoint::max() = no deadline
+    void WaitUntil(TimePoint deadline)
+    {
+        using namespace std::chrono;
+        if (deadline == TimePoint::max())
+        {
+            _sema.Wait();
+            return;
+        }
+        auto now = steady_clock::now();
+        if (deadline > now)
+        {
+            auto us = duration_cast<microseconds>(deadline - now);
+            if (us < deadline - now)
+                ++us;
+            _sema.WaitFor(static_cast<unsigned long long>(us.count()));
+        }
+    }
+private:
+    zonciu::Semaphore _sema;
+};
+#endif
+//Fixed size object pool, grows by slabs of [SlabSize], never shrinks.
+//The free list is a lock-free queue, the lock is only taken to add a slab.
+template<class T, std::size_t SlabSize = 64>
+class SlabPool
+{
+public:
+    SlabPool() = default;
+    T* Acquire()
+    {
+        T* ret = nullptr;
+        if (_free.try_dequeue(ret))
+            return ret;
+        zonciu::SpinGuard lck(_lock);
+        // another thread may have grown the pool meanwhile
+        if (_free.try_dequeue(ret))
+            return ret;
+        _slabs.emplace_back(new T[SlabSize]);
+        T* slab = _slabs.back().get();
+        T* rest[SlabSize - 1];
+        for (std::size_t i = 1; i < SlabSize; ++i)
+            rest[i - 1] = &slab[i];
+        _free.enqueue_bulk(rest, SlabSize - 1);
+        return &slab[0];
+    }
+    void Release(T* p)
+    {
+        _free.enqueue(p);
+    }
+private:
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+    zonciu::SpinLock _lock;
+    std::vector<std::unique_ptr<T[]>> _slabs;
+    moodycamel::ConcurrentQueue<T*> _free;
+};
+} // namespace detail
+//Time source of MinHeapTimer
+class TimerClock
+{
+public:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+    virtual ~TimerClock() {}
+    virtual TimePoint Now() = 0;
+    //Virtual clocks only move on Advance, timers must not sleep on them
+    virtual bool IsVirtual() const { return false; }
+    //Virtual clocks call [listener] after every Advance, return subscription id
+    virtual int Subscribe(std::function<void()> listener) { (void)listener; return -1; }
+    virtual void Unsubscribe(int subscription) { (void)subscription; }
+};
+//Default clock, std::chrono::steady_clock
+class SteadyTimerClock : public TimerClock
+{
+public:
+    TimePoint Now() override { return std::chrono::steady_clock::now(); }
+};
+//Manually advanced clock for tests and benchmarks.
+//Use MinHeapTimer::Sync after Advance to wait for the fired handlers.
+class VirtualClock : public TimerClock
+{
+public:
+    explicit VirtualClock(TimePoint start = TimePoint()) : _now(start.time_since_epoch().count()), _next_id(0) {}
+    TimePoint Now() override { return TimePoint(TimePoint::duration(_now.load())); }
+    bool IsVirtual() const override { return true; }
+    int Subscribe(std::function<void()> listener) override
+    {
+        zonciu::SpinGuard lck(_lock);
+        _listeners.push_back(std::make_pair(_next_id, std::move(listener)));
+        return _next_id++;
+    }
+    void Unsubscribe(int subscription) override
+    {
+        zonciu::SpinGuard lck(_lock);
+        for (auto it = _listeners.begin(); it != _listeners.end(); ++it)
+        {
+            if (it->first == subscription)
+            {
+                _listeners.erase(it);
+                return;
+            }
+        }
+    }
+    template<class _Rep, class _Period>
+    void Advance(std::chrono::duration<_Rep, _Period> time)
+    {
+        _now += std::chrono::duration_cast<TimePoint::duration>(time).count();
+        Notify();
+    }
+    void AdvanceTo(TimePoint time)
+    {
+        _now.store(time.time_since_epoch().count());
+        Notify();
+    }
+private:
+    void Notify()
+    {
+        zonciu::SpinGuard lck(_lock);
+        for (auto& it : _listeners)
+            it.second();
+    }
+    std::atomic<TimePoint::rep> _now;
+    zonciu::SpinLock _lock;
+    int _next_id;
+    std::vector<std::pair<int, std::function<void()>>> _listeners;
+};
 /*
  * Min heap timer.
+ * Jobs know their heap position, so Remove takes them out in O(log n).
+ * The heap belongs to the observer thread. SetInterval/SetTimeout/Remove
+ * claim an id in a lock-free slot table and queue a command for it, so
+ * callers never wait on the observer.
+ * Reschedule/Extend move a live timer in place, no allocation.
+ * Interval timers take an IntervalPolicy: fixed rate or fixed delay,
+ * what to do with missed runs, and whether runs may overlap.
+ * Time comes from a TimerClock, steady_clock by default. With a
+ * VirtualClock the observer only wakes on Advance and Sync gives
+ * deterministic runs without real sleeps.
+ * Expired handlers run on a pool of workers:
+ * | Dispatch::any   - all workers share one queue
+ * | Dispatch::by_id - one queue per worker, picked by timer_id,
+ * |                   handlers of the same timer never overlap
+ * Jobs come from a slab pool, handlers are stored inline (48 bytes) and
+ * ids index a dense slot table, so timer churn does not allocate once
+ * the pool is warm.
+ * SetInlineBudget runs short handlers on the observer thread within a
+ * per-wakeup time budget, skipping the worker queue.
+ * SetPrecisionWait sleeps to a calibrated margin before each deadline and
+ * spins the rest, within a CPU budget.
+ * EnableMetrics turns on lock-free histograms of lateness, queue depth and
+ * callback time, read with Metrics() at any time.
+ * Slack: a job may fire anywhere in [interval, interval + slack].
+ * The observer wakes when the first window closes and fires every job
+ * whose window is open at that moment in one batch.
  * api:
- * | SetInterval - return (unsigned int)timer_id
- * | SetTimeOut  - return (unsigned int)timer_id
- * | StopTimer
- * | StopAll
+ * | SetInterval - return timer_id
+ * | SetTimeOut  - return timer_id
+ * | Reschedule  - fire [delay] from now
+ * | Extend      - move the deadline by [delta]
+ * | Remove
+ * | Clear
 */
 class MinHeapTimer
 {
-    typedef std::function<void()> TimerHandle;
-    typedef int TimerId;
+public:
+    typedef zonciu::InplaceFunction<void(), 48> TimerHandle;
+    //high 32 bits: slot generation, low 32 bits: slot index
+    typedef std::int64_t TimerId;
     typedef std::chrono::duration<std::uint64_t, std::micro> IntervalType;
+    enum class Dispatch
+    {
+        any,
+        by_id
+    };
+    struct QueueStats
+    {
+        std::size_t depth;      // handlers waiting now
+        std::size_t peak_depth; // max depth seen
+        std::uint64_t executed; // handlers run
+    };
+    //One entry of SetTimeouts
+    struct TimeoutEntry
+    {
+        TimeoutEntry() : delay(0), slack(0) {}
+        TimeoutEntry(std::chrono::microseconds _delay, TimerHandle _func,
+            std::chrono::microseconds _slack = std::chrono::microseconds::zero())
+            :
+            delay(_delay), func(std::move(_func)), slack(_slack)
+        {}
+        std::chrono::microseconds delay;
+        TimerHandle func;
+        std::chrono::microseconds slack;
+    };
+    //Runtime metrics, see EnableMetrics
+    struct MetricsSnapshot
+    {
+        Histogram::Snapshot lateness;      // microseconds from next_time to posting
+        Histogram::Snapshot queue_depth;   // handlers waiting, sampled on every post
+        Histogram::Snapshot callback_time; // nanoseconds per handler
+        std::size_t live;                  // live timers
+        std::uint64_t cancelled;           // removes applied
+        std::size_t heap_size;             // jobs in heap after the last pass
+        std::size_t peak_heap_size;
+    };
+    //How an interval timer picks its next run
+    //| fixed_rate  - every [interval] on the original schedule
+    //| fixed_delay - [interval] after the previous run returned, never overlaps
+    enum class IntervalMode
+    {
+        fixed_rate,
+        fixed_delay
+    };
+    //What a fixed_rate timer does after falling behind by whole intervals
+    //| fire_all - run once per missed interval, back to back
+    //| coalesce - run once for all missed intervals
+    //| skip     - drop missed runs, wait for the next interval on schedule
+    enum class Overrun
+    {
+        fire_all,
+        coalesce,
+        skip
+    };
+    struct IntervalPolicy
+    {
+        IntervalPolicy(IntervalMode _mode = IntervalMode::fixed_rate, Overrun _overrun = Overrun::fire_all,
+            bool _no_overlap = false)
+            :
+            mode(_mode), overrun(_overrun), no_overlap(_no_overlap)
+        {}
+        IntervalMode mode;
+        Overrun overrun;
+        // fixed_rate: drop a run while the previous one is still queued or running
+        bool no_overlap;
+    };
 private:
+    typedef std::chrono::time_point<std::chrono::steady_clock, std::chrono::microseconds> TimePoint;
+    enum
+    {
+        kSlotChunkBits = 12,
+        kSlotChunkSize = 1 << kSlotChunkBits,
+        kSlotChunks = 4096,
+        // wake a sleeping observer once this many commands are queued
+        kDrainBatch = 1024,
+        // commands built on the stack per SetTimeouts/RemoveMany enqueue
+        kBulkBatch = 256
+    };
+    static const std::size_t npos = static_cast<std::size_t>(-1);
     enum class Flag
     {
-        stop,
         once,
         forever
     };
+    // What the observer does with a collected job after posting
+    enum class Step
+    {
+        reschedule, // stays in heap with a new next_time
+        finish,     // leaves heap, drop heap ref
+        detach      // leaves heap, keep heap ref for a pending remove/rearm
+    };
     struct Job
     {
-        Job(TimerId _id, Flag _flag, IntervalType _interval, TimerHandle _handle)
-            :
-            id(_id), interval(_interval), handle(_handle), flag(_flag)
-        {}
-        struct Comp
+        Job() : id(0), index(npos), flag(Flag::once), added(false), cancelled(false), firing(false), slow(false),
+            step(Step::finish), refs(0) {}
+        TimerId id;
+        IntervalType interval;
+        TimerHandle handle;
+        IntervalType slack;
+        // steady_clock, wall clock changes do not move deadlines
+        TimePoint next_time;
+        // next_time + slack, heap key
+        TimePoint deadline;
+        // position in _jobs, npos when not in heap
+        std::size_t index;
+        Flag flag;
+        IntervalPolicy policy;
+        // observer only, add and remove commands may arrive in any order
+        bool added;
+        bool cancelled;
+        bool firing;
+        // ran over the inline budget once, always goes to the workers
+        bool slow;
+        Step step;
+        // one for the heap, one per queued run
+        std::atomic<int> refs;
+    };
+    struct Slot
+    {
+        // generation << 1 | live
+        std::atomic<std::uint64_t> state;
+        Job* job;
+    };
+    struct Command
+    {
+        enum class Op
         {
-            bool operator()(const Job* const _left, const Job* const _right)
-            {
-                return (_left->next_time > _right->next_time);
-            }
+            add,
+            remove,
+            reschedule, // value = new next_time
+            extend,     // value = delta
+            rearm       // value = next_time after a fixed_delay run
         };
-        const TimerId id;
-        const IntervalType interval;
-        const TimerHandle handle;
-        std::chrono::time_point<std::chrono::high_resolution_clock, std::chrono::microseconds> next_time;
-        Flag flag;
+        Op op;
+        // add/remove
+        Job* job;
+        // reschedule/extend, microseconds
+        TimerId id;
+        std::int64_t value;
+    };
+    struct Lane
+    {
+        Lane() : enqueued(0), executed(0), peak(0) {}
+        moodycamel::BlockingConcurrentQueue<Job*> queue;
+        std::atomic<std::uint64_t> enqueued;
+        std::atomic<std::uint64_t> executed;
+        std::atomic<std::uint64_t> peak;
+    };
+    struct MetricsData
+    {
+        MetricsData() : cancelled(0), heap_size(0), peak_heap_size(0) {}
+        Histogram lateness;
+        Histogram queue_depth;
+        Histogram callback_time;
+        std::atomic<std::uint64_t> cancelled;
+        std::atomic<std::size_t> heap_size;
+        std::atomic<std::size_t> peak_heap_size;
     };
 public:
-    MinHeapTimer() : _jobs_id_count(0), _destructed(false)
+    //clock: nullptr = steady_clock, must outlive the timer
+    explicit MinHeapTimer(unsigned int worker_count = 1, Dispatch dispatch = Dispatch::any,
+        TimerClock* clock = nullptr)
+        :
+        _clock(clock ? clock : &_steady_clock), _subscription(-1),
+        _destructed(false), _pending(0), _wake_at(kAwake), _pass_begin(0), _pass_end(0),
+        _slot_count(0), _live(0), _inline_budget(0), _inline_runs(0),
+        _spin_budget(0), _spin_margin(0),
+        _metrics_on(false), _metrics(new MetricsData), _max_slack(IntervalType::zero()), _staged(0), _oversleep(50), _spin_used(0)
     {
+        if (_clock->IsVirtual())
+            _subscription = _clock->Subscribe([this]() { _waiter.Signal(); });
+        for (auto& chunk : _slot_chunks)
+            chunk.store(nullptr, std::memory_order_relaxed);
+        if (worker_count == 0)
+            worker_count = 1;
+        unsigned int lane_count = (dispatch == Dispatch::by_id) ? worker_count : 1;
+        for (unsigned int i = 0; i < lane_count; ++i)
+            _lanes.emplace_back(new Lane);
         _observer = std::thread(&MinHeapTimer::Observe, this);
-        _worker = std::thread(&MinHeapTimer::Worker, this);
+        for (unsigned int i = 0; i < worker_count; ++i)
+            _workers.emplace_back(&MinHeapTimer::Worker, this, _lanes[i % lane_count].get());
     }
     ~MinHeapTimer()
     {
+        if (_subscription >= 0)
+            _clock->Unsubscribe(_subscription);
         _destructed = true;
-        _work_queue.enqueue([]() {});
+        for (std::size_t i = 0; i < _workers.size(); ++i)
+            _lanes[i % _lanes.size()]->queue.enqueue(nullptr);
         Clear();
-        _worker.join();
+        _waiter.Signal();
+        for (auto& worker : _workers)
+            worker.join();
         _observer.join();
+        for (auto& chunk : _slot_chunks)
+            delete[] chunk.load(std::memory_order_relaxed);
     }
     //Wait and run
+    //slack: how late the job may fire, lets the observer batch wakeups
     //Return timer_id
-    TimerId SetInterval(std::uint32_t interval_milli, TimerHandle func)
+    TimerId SetInterval(std::uint32_t interval_milli, TimerHandle func,
+        std::chrono::microseconds slack = std::chrono::microseconds::zero())
     {
-        using namespace std::chrono;
-        TimerId ret_id = _jobs_id_count++;
-        auto* tmp = new Job(ret_id, Flag::forever, IntervalType(milliseconds(interval_milli)), func);
-        tmp->next_time = time_point_cast<microseconds>(high_resolution_clock::now() + tmp->interval);
-        zonciu::SpinGuard idlck(_id_lock);
-        _jobs_id.insert(std::make_pair(ret_id, tmp));
-        zonciu::SpinGuard joblck(_jobs_lock);
-        _jobs.push(tmp);
-        _waiter.Signal();
-        return ret_id;
+        return AddJob(Flag::forever, std::chrono::milliseconds(interval_milli), func, slack, IntervalPolicy());
     }
     template<class _Rep, class _Period>
-    TimerId SetInterval(std::chrono::duration<_Rep, _Period> interval, TimerHandle func)
+    TimerId SetInterval(std::chrono::duration<_Rep, _Period> interval, TimerHandle func,
+        std::chrono::microseconds slack = std::chrono::microseconds::zero())
     {
-        using namespace std::chrono;
-        TimerId ret_id = _jobs_id_count++;
-        auto* tmp = new Job(ret_id, Flag::forever, duration_cast<microseconds>(interval), func);
-        tmp->next_time = time_point_cast<microseconds>(high_resolution_clock::now() + tmp->interval);
-        zonciu::SpinGuard idlck(_id_lock);
-        _jobs_id.insert(std::make_pair(ret_id, tmp));
-        zonciu::SpinGuard joblck(_jobs_lock);
-        _jobs.push(tmp);
-        _waiter.Signal();
-        return ret_id;
+        return AddJob(Flag::forever, interval, func, slack, IntervalPolicy());
+    }
+    TimerId SetInterval(std::uint32_t interval_milli, TimerHandle func, IntervalPolicy policy,
+        std::chrono::microseconds slack = std::chrono::microseconds::zero())
+    {
+        return AddJob(Flag::forever, std::chrono::milliseconds(interval_milli), func, slack, policy);
+    }
+    template<class _Rep, class _Period>
+    TimerId SetInterval(std::chrono::duration<_Rep, _Period> interval, TimerHandle func, IntervalPolicy policy,
+        std::chrono::microseconds slack = std::chrono::microseconds::zero())
+    {
+        return AddJob(Flag::forever, interval, func, slack, policy);
     }
     //Wait and run once
+    //slack: how late the job may fire, lets the observer batch wakeups
     //Return timer_id
-    TimerId SetTimeout(std::uint32_t interval_milli, TimerHandle func)
+    TimerId SetTimeout(std::uint32_t interval_milli, TimerHandle func,
+        std::chrono::microseconds slack = std::chrono::microseconds::zero())
     {
-        using namespace std::chrono;
-        TimerId ret_id = _jobs_id_count++;
-        auto* tmp = new Job(ret_id, Flag::once, IntervalType(milliseconds(interval_milli)), func);
-        tmp->next_time = tmp->next_time = time_point_cast<microseconds>(high_resolution_clock::now() + tmp->interval);
-        zonciu::SpinGuard idlck(_id_lock);
-        _jobs_id.insert(std::make_pair(ret_id, tmp));
-        zonciu::SpinGuard joblck(_jobs_lock);
-        _jobs.push(tmp);
-        _waiter.Signal();
-        return ret_id;
+        return AddJob(Flag::once, std::chrono::milliseconds(interval_milli), func, slack, IntervalPolicy());
     }
     template<class _Rep, class _Period>
-    TimerId SetTimeout(std::chrono::duration<_Rep, _Period> interval, TimerHandle func)
+    TimerId SetTimeout(std::chrono::duration<_Rep, _Period> interval, TimerHandle func,
+        std::chrono::microseconds slack = std::chrono::microseconds::zero())
+    {
+        return AddJob(Flag::once, interval, func, slack, IntervalPolicy());
+    }
+    //Register [count] timeouts with one queue operation per 256 entries and
+    //at most one observer wakeup. func of every entry is moved out.
+    //ids: [count] slots, receive the timer_ids in entry order
+    void SetTimeouts(TimeoutEntry* entries, std::size_t count, TimerId* ids)
     {
         using namespace std::chrono;
-        TimerId ret_id = _jobs_id_count++;
-        auto* tmp = new Job(ret_id, Flag::once, duration_cast<microseconds>(interval), func);
-        tmp->next_time = time_point_cast<microseconds>(high_resolution_clock::now() + tmp->interval);
-        zonciu::SpinGuard idlck(_id_lock);
-        _jobs_id.insert(std::make_pair(ret_id, tmp));
-        zonciu::SpinGuard joblck(_jobs_lock);
-        _jobs.push(tmp);
-        _waiter.Signal();
-        return ret_id;
+        auto now = _clock->Now();
+        Command cmds[kBulkBatch];
+        std::size_t batch = 0;
+        std::int64_t earliest = kNoDeadline;
+        try
+        {
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                Job* tmp = MakeJob(Flag::once, entries[i].delay, entries[i].func, entries[i].slack,
+                    IntervalPolicy(), now);
+                ids[i] = tmp->id;
+                Command cmd = { Command::Op::add, tmp, tmp->id, 0 };
+                cmds[batch++] = cmd;
+                if (tmp->deadline.time_since_epoch().count() < earliest)
+                    earliest = tmp->deadline.time_since_epoch().count();
+                if (batch == kBulkBatch)
+                {
+                    SubmitBulk(cmds, batch, earliest);
+                    batch = 0;
+                }
+            }
+        }
+        catch (...)
+        {
+            SubmitBulk(cmds, batch, earliest);
+            throw;
+        }
+        SubmitBulk(cmds, batch, earliest);
     }
-    //Return false if timer not found
-    bool Remove(TimerId timer_id)
+    std::vector<TimerId> SetTimeouts(std::vector<TimeoutEntry>& entries)
     {
-        zonciu::SpinGuard idlck(_id_lock);
-        auto it = _jobs_id.find(timer_id);
-        if (it != _jobs_id.end())
+        std::vector<TimerId> ret(entries.size());
+        if (!entries.empty())
+            SetTimeouts(entries.data(), entries.size(), ret.data());
+        return ret;
+    }
+    //Remove [count] timers with one queue operation per 256 ids
+    //Return number of timers found
+    std::size_t RemoveMany(const TimerId* ids, std::size_t count)
+    {
+        Command cmds[kBulkBatch];
+        std::size_t batch = 0;
+        std::size_t removed = 0;
+        for (std::size_t i = 0; i < count; ++i)
         {
-            it->second->flag = Flag::stop;
-            return true;
+            Job* tmp = ClaimSlot(ids[i]);
+            if (!tmp)
+                continue;
+            Command cmd = { Command::Op::remove, tmp, ids[i], 0 };
+            cmds[batch++] = cmd;
+            ++removed;
+            if (batch == kBulkBatch)
+            {
+                SubmitBulk(cmds, batch, kNoDeadline);
+                batch = 0;
+            }
         }
-        else
+        SubmitBulk(cmds, batch, kNoDeadline);
+        return removed;
+    }
+    std::size_t RemoveMany(const std::vector<TimerId>& ids)
+    {
+        return ids.empty() ? 0 : RemoveMany(ids.data(), ids.size());
+    }
+    //Return false if timer not found
+    //The job leaves the heap on the observer's next pass
+    bool Remove(TimerId timer_id)
+    {
+        Job* tmp = ClaimSlot(timer_id);
+        if (!tmp)
             return false;
+        Command cmd = { Command::Op::remove, tmp, timer_id, 0 };
+        Submit(cmd, kNoDeadline);
+        return true;
+    }
+    //Next run is [delay] from now, interval timers keep their interval after it
+    //Return false if timer not found
+    bool Reschedule(TimerId timer_id, std::uint32_t delay_milli)
+    {
+        return Reschedule(timer_id, std::chrono::milliseconds(delay_milli));
+    }
+    template<class _Rep, class _Period>
+    bool Reschedule(TimerId timer_id, std::chrono::duration<_Rep, _Period> delay)
+    {
+        using namespace std::chrono;
+        if (!IsLive(timer_id))
+            return false;
+        std::int64_t next = time_point_cast<microseconds>(_clock->Now()
+            + duration_cast<microseconds>(delay)).time_since_epoch().count();
+        Command cmd = { Command::Op::reschedule, nullptr, timer_id, next };
+        Submit(cmd, next);
+        return true;
+    }
+    //Move the next run by [delta], negative delta runs it earlier
+    //Return false if timer not found
+    bool Extend(TimerId timer_id, std::int32_t delta_milli)
+    {
+        return Extend(timer_id, std::chrono::milliseconds(delta_milli));
+    }
+    template<class _Rep, class _Period>
+    bool Extend(TimerId timer_id, std::chrono::duration<_Rep, _Period> delta)
+    {
+        using namespace std::chrono;
+        if (!IsLive(timer_id))
+            return false;
+        std::int64_t value = duration_cast<microseconds>(delta).count();
+        Command cmd = { Command::Op::extend, nullptr, timer_id, value };
+        // only an earlier deadline needs the observer awake
+        Submit(cmd, value < 0 ? time_point_cast<microseconds>(_clock->Now()).time_since_epoch().count()
+            : kNoDeadline);
+        return true;
     }
     void Clear()
     {
         //printf("MinHeapTimer Clear begin\n");
-        zonciu::SpinGuard idlck(_id_lock);
-        zonciu::SpinGuard joblck(_jobs_lock);
-        Job* tmp = nullptr;
-        while (!_jobs.empty())
+        std::uint32_t count = _slot_count.load(std::memory_order_acquire);
+        for (std::uint32_t index = 0; index < count; ++index)
         {
-            tmp = _jobs.top();
-            _jobs.pop();
-            delete tmp;
+            Slot* slot = GetSlot(index);
+            std::uint64_t state = slot->state.load(std::memory_order_acquire);
+            if (!(state & 1))
+                continue;
+            TimerId timer_id = static_cast<TimerId>((state >> 1) << 32 | index);
+            Job* tmp = ClaimSlot(timer_id);
+            if (tmp)
+            {
+                Command cmd = { Command::Op::remove, tmp, timer_id, 0 };
+                Submit(cmd, kNoDeadline);
+            }
         }
-        _jobs_id.clear();
-        _waiter.Signal();
         //printf("MinHeapTimer Clear end\n");
     }
+    //Number of live timers
+    size_t Size() const
+    {
+        return _live.load(std::memory_order_relaxed);
+    }
+    size_t WorkerCount() const { return _workers.size(); }
+    //Block until commands issued before the call are applied, every job due
+    //at the clock's current time is posted and the workers ran them.
+    //Handlers that keep adding due work make Sync wait for that too.
+    void Sync()
+    {
+        std::uint64_t pass = _pass_begin.load();
+        while (_pass_end.load() <= pass)
+        {
+            _waiter.Signal();
+            std::this_thread::yield();
+        }
+        for (auto& lane : _lanes)
+        {
+            std::uint64_t target = lane->enqueued.load();
+            while (lane->executed.load() < target)
+                std::this_thread::yield();
+        }
+    }
+    TimerClock& Clock() { return *_clock; }
+    //Run due handlers on the observer thread instead of a worker, saves the
+    //queue hop for short callbacks. Inline runs of one wakeup share [budget],
+    //the rest go to the workers; a handler that alone takes longer than
+    //[budget] is never run inline again. zero = off (default)
+    void SetInlineBudget(std::chrono::microseconds budget)
+    {
+        _inline_budget.store(budget.count() > 0 ? budget.count() : 0, std::memory_order_relaxed);
+    }
+    std::chrono::microseconds InlineBudget() const
+    {
+        return std::chrono::microseconds(_inline_budget.load(std::memory_order_relaxed));
+    }
+    //Precision wait: the observer sleeps until [margin] before a deadline and
+    //spins the rest, trading CPU for wakeup jitter in the low microseconds.
+    //spin_budget: max spinning per second of wall time, zero = off (default);
+    //past it the observer just sleeps until the deadline.
+    //margin: zero = calibrated from the measured oversleep of this machine.
+    void SetPrecisionWait(std::chrono::microseconds spin_budget,
+        std::chrono::microseconds margin = std::chrono::microseconds::zero())
+    {
+        _spin_margin.store(margin.count() > 0 ? margin.count() : 0, std::memory_order_relaxed);
+        _spin_budget.store(spin_budget.count() > 0 ? spin_budget.count() : 0, std::memory_order_relaxed);
+        _waiter.Signal();
+    }
+    std::chrono::microseconds SpinBudget() const
+    {
+        return std::chrono::microseconds(_spin_budget.load(std::memory_order_relaxed));
+    }
+    //Collect lateness, queue depth and callback time histograms plus heap
+    //gauges. Off by default, costs one relaxed load per hook when off.
+    void EnableMetrics(bool on)
+    {
+        _metrics_on.store(on, std::memory_order_relaxed);
+    }
+    bool MetricsEnabled() const { return _metrics_on.load(std::memory_order_relaxed); }
+    MetricsSnapshot Metrics() const
+    {
+        MetricsSnapshot ret;
+        ret.lateness = _metrics->lateness.Snap();
+        ret.queue_depth = _metrics->queue_depth.Snap();
+        ret.callback_time = _metrics->callback_time.Snap();
+        ret.live = Size();
+        ret.cancelled = _metrics->cancelled.load(std::memory_order_relaxed);
+        ret.heap_size = _metrics->heap_size.load(std::memory_order_relaxed);
+        ret.peak_heap_size = _metrics->peak_heap_size.load(std::memory_order_relaxed);
+        return ret;
+    }
+    void ResetMetrics()
+    {
+        _metrics->lateness.Reset();
+        _metrics->queue_depth.Reset();
+        _metrics->callback_time.Reset();
+        _metrics->cancelled.store(0, std::memory_order_relaxed);
+        _metrics->peak_heap_size.store(0, std::memory_order_relaxed);
+    }
+    //Handlers run on the observer thread so far
+    std::uint64_t InlineRuns() const { return _inline_runs.load(std::memory_order_relaxed); }
+    //Slot index of a timer_id stays below this, bits above it are always 0
+    static constexpr std::uint32_t MaxTimers() { return static_cast<std::uint32_t>(kSlotChunkSize) * kSlotChunks; }
+    //One entry per queue, Dispatch::any has a single queue
+    std::vector<QueueStats> Stats() const
+    {
+        std::vector<QueueStats> ret;
+        ret.reserve(_lanes.size());
+        for (auto& lane : _lanes)
+        {
+            QueueStats stats;
+            stats.executed = lane->executed.load(std::memory_order_relaxed);
+            stats.depth = lane->queue.size_approx();
+            stats.peak_depth = static_cast<std::size_t>(lane->peak.load(std::memory_order_relaxed));
+            ret.push_back(stats);
+        }
+        return ret;
+    }
 private:
+    // _wake_at while the observer is running, callers never need to signal
+    static const std::int64_t kAwake = INT64_MIN;
+    static const std::int64_t kNoDeadline = INT64_MAX;
+    // calibrated spin margin bounds, microseconds
+    static const std::int64_t kMinMargin = 10;
+    static const std::int64_t kMaxMargin = 2000;
+    template<class _Rep, class _Period>
+    TimerId AddJob(Flag flag, std::chrono::duration<_Rep, _Period> interval, TimerHandle& func,
+        std::chrono::microseconds slack, const IntervalPolicy& policy)
+    {
+        Job* tmp = MakeJob(flag, interval, func, slack, policy, _clock->Now());
+        Command cmd = { Command::Op::add, tmp, tmp->id, 0 };
+        Submit(cmd, tmp->deadline.time_since_epoch().count());
+        return tmp->id;
+    }
+    // Job with a live slot, not yet known to the observer
+    template<class _Rep, class _Period>
+    Job* MakeJob(Flag flag, std::chrono::duration<_Rep, _Period> interval, TimerHandle& func,
+        std::chrono::microseconds slack, const IntervalPolicy& policy, std::chrono::steady_clock::time_point now)
+    {
+        using namespace std::chrono;
+        Job* tmp = _pool.Acquire();
+        tmp->flag = flag;
+        tmp->policy = policy;
+        tmp->slow = false;
+        tmp->interval = duration_cast<microseconds>(interval);
+        tmp->slack = slack.count() > 0 ? IntervalType(slack.count()) : IntervalType::zero();
+        tmp->handle = std::move(func);
+        tmp->index = npos;
+        tmp->added = false;
+        tmp->cancelled = false;
+        tmp->refs.store(1, std::memory_order_relaxed);
+        tmp->next_time = time_point_cast<microseconds>(now + tmp->interval);
+        tmp->deadline = tmp->next_time + tmp->slack;
+        try
+        {
+            AllocSlot(tmp);
+        }
+        catch (...)
+        {
+            tmp->refs.store(0, std::memory_order_relaxed);
+            tmp->handle.Reset();
+            _pool.Release(tmp);
+            throw;
+        }
+        return tmp;
+    }
+    // Hand a command to the observer, wake it only when it sleeps past
+    // [deadline] or the queue grows long
+    void Submit(const Command& cmd, std::int64_t deadline)
+    {
+        _commands.enqueue(cmd);
+        std::uint32_t pending = _pending.fetch_add(1) + 1;
+        if (deadline < _wake_at.load() || pending == kDrainBatch)
+            _waiter.Signal();
+    }
+    void SubmitBulk(const Command* cmds, std::size_t count, std::int64_t deadline)
+    {
+        if (!count)
+            return;
+        _commands.enqueue_bulk(cmds, count);
+        std::uint32_t pending = _pending.fetch_add(static_cast<std::uint32_t>(count))
+            + static_cast<std::uint32_t>(count);
+        if (deadline < _wake_at.load() || (pending >= kDrainBatch && pending - count < kDrainBatch))
+            _waiter.Signal();
+    }
+    // Lock-free dense id table.
+    // Slots live in chunks that are never freed, claiming a slot bumps its
+    // generation, so stale ids never match.
+    Slot* GetSlot(std::uint32_t index)
+    {
+        auto& chunk = _slot_chunks[index >> kSlotChunkBits];
+        Slot* slots = chunk.load(std::memory_order_acquire);
+        if (!slots)
+        {
+            Slot* fresh = new Slot[kSlotChunkSize]();
+            if (chunk.compare_exchange_strong(slots, fresh, std::memory_order_acq_rel))
+                slots = fresh;
+            else
+                delete[] fresh;
+        }
+        return &slots[index & (kSlotChunkSize - 1)];
+    }
+    TimerId AllocSlot(Job* job)
+    {
+        std::uint32_t index;
+        if (!_free_slots.try_dequeue(index))
+        {
+            index = _slot_count.fetch_add(1);
+            if (index >= static_cast<std::uint32_t>(kSlotChunkSize) * kSlotChunks)
+                throw std::runtime_error("MinHeapTimer: too many timers");
+        }
+        Slot* slot = GetSlot(index);
+        std::uint64_t gen = slot->state.load(std::memory_order_relaxed) >> 1;
+        slot->job = job;
+        job->id = static_cast<TimerId>(gen << 32 | index);
+        ++_live;
+        slot->state.store(gen << 1 | 1, std::memory_order_release);
+        return job->id;
+    }
+    // Take ownership of a live timer, return nullptr if it is gone
+    Job* ClaimSlot(TimerId timer_id)
+    {
+        std::uint64_t index = static_cast<std::uint64_t>(timer_id) & 0xffffffffULL;
+        std::uint64_t gen = static_cast<std::uint64_t>(timer_id) >> 32;
+        if (timer_id < 0 || index >= _slot_count.load(std::memory_order_acquire))
+            return nullptr;
+        Slot* slot = GetSlot(static_cast<std::uint32_t>(index));
+        std::uint64_t expected = gen << 1 | 1;
+        // keep ids positive
+        std::uint64_t next = ((gen + 1) & 0x7fffffff) << 1;
+        if (!slot->state.compare_exchange_strong(expected, next, std::memory_order_acq_rel))
+            return nullptr;
+        Job* job = slot->job;
+        --_live;
+        _free_slots.enqueue(static_cast<std::uint32_t>(index));
+        return job;
+    }
+    bool IsLive(TimerId timer_id)
+    {
+        return FindLive(timer_id) != nullptr;
+    }
+    // Job of a live timer, only the observer may use the result
+    Job* FindLive(TimerId timer_id)
+    {
+        std::uint64_t index = static_cast<std::uint64_t>(timer_id) & 0xffffffffULL;
+        std::uint64_t gen = static_cast<std::uint64_t>(timer_id) >> 32;
+        if (timer_id < 0 || index >= _slot_count.load(std::memory_order_acquire))
+            return nullptr;
+        Slot* slot = GetSlot(static_cast<std::uint32_t>(index));
+        if (slot->state.load(std::memory_order_acquire) != (gen << 1 | 1))
+            return nullptr;
+        return slot->job;
+    }
+    void Release(Job* job)
+    {
+        if (job->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            job->handle = nullptr;
+            _pool.Release(job);
+        }
+    }
+    // The heap reference is dropped by whichever of add/remove comes last
+    void Apply(const Command& cmd)
+    {
+        Job* job = cmd.job;
+        // everything but add needs a valid heap
+        if (cmd.op != Command::Op::add)
+            HeapFlush();
+        switch (cmd.op)
+        {
+        case Command::Op::add:
+        {
+            job->added = true;
+            if (job->cancelled)
+            {
+                Release(job);
+                break;
+            }
+            if (job->slack > _max_slack)
+                _max_slack = job->slack;
+            HeapStage(job);
+            break;
+        }
+        case Command::Op::remove:
+        {
+            if (_metrics_on.load(std::memory_order_relaxed))
+                _metrics->cancelled.fetch_add(1, std::memory_order_relaxed);
+            job->cancelled = true;
+            if (job->added)
+            {
+                if (job->index != npos)
+                    HeapErase(job->index);
+                Release(job);
+            }
+            break;
+        }
+        case Command::Op::reschedule:
+        case Command::Op::extend:
+        {
+            // a job whose add is still queued is pushed with the new time
+            job = FindLive(cmd.id);
+            if (!job)
+                break;
+            if (cmd.op == Command::Op::reschedule)
+                job->next_time = TimePoint(std::chrono::microseconds(cmd.value));
+            else
+                job->next_time += std::chrono::microseconds(cmd.value);
+            job->deadline = job->next_time + job->slack;
+            if (job->index != npos)
+                HeapFix(job->index);
+            break;
+        }
+        case Command::Op::rearm:
+        {
+            // dropped if removed while running
+            job = FindLive(cmd.id);
+            if (!job || job->cancelled)
+                break;
+            job->next_time = TimePoint(std::chrono::microseconds(cmd.value));
+            job->deadline = job->next_time + job->slack;
+            if (job->index != npos)
+                HeapFix(job->index);
+            else
+                HeapPush(job);
+            break;
+        }
+        }
+    }
+    // Indexed binary heap on _jobs, earliest deadline on top.
+    // Observer thread only.
+    void HeapSet(std::size_t index, Job* job)
+    {
+        _jobs[index] = job;
+        job->index = index;
+    }
+    void SiftUp(std::size_t index)
+    {
+        Job* job = _jobs[index];
+        while (index > 0)
+        {
+            std::size_t parent = (index - 1) / 2;
+            if (!(job->deadline < _jobs[parent]->deadline))
+                break;
+            HeapSet(index, _jobs[parent]);
+            index = parent;
+        }
+        HeapSet(index, job);
+    }
+    void SiftDown(std::size_t index)
+    {
+        Job* job = _jobs[index];
+        std::size_t size = _jobs.size();
+        for (;;)
+        {
+            std::size_t child = index * 2 + 1;
+            if (child >= size)
+                break;
+            if (child + 1 < size && _jobs[child + 1]->deadline < _jobs[child]->deadline)
+                ++child;
+            if (!(_jobs[child]->deadline < job->deadline))
+                break;
+            HeapSet(index, _jobs[child]);
+            index = child;
+        }
+        HeapSet(index, job);
+    }
+    // Restore heap order after _jobs[index]->deadline changed
+    void HeapFix(std::size_t index)
+    {
+        if (index > 0 && _jobs[index]->deadline < _jobs[(index - 1) / 2]->deadline)
+            SiftUp(index);
+        else
+            SiftDown(index);
+    }
+    void HeapPush(Job* job)
+    {
+        _jobs.push_back(job);
+        SiftUp(_jobs.size() - 1);
+    }
+    // Append without sifting, HeapFlush restores the heap
+    void HeapStage(Job* job)
+    {
+        _jobs.push_back(job);
+        job->index = _jobs.size() - 1;
+        ++_staged;
+    }
+    // Sift staged jobs up one by one, or rebuild the whole heap in O(n)
+    // when a bulk add staged a large share of it
+    void HeapFlush()
+    {
+        if (!_staged)
+            return;
+        std::size_t size = _jobs.size();
+        if (_staged * 16 >= size)
+        {
+            for (std::size_t index = size / 2; index-- > 0;)
+                SiftDown(index);
+        }
+        else
+        {
+            for (std::size_t index = size - _staged; index < size; ++index)
+                SiftUp(index);
+        }
+        _staged = 0;
+    }
+    void HeapErase(std::size_t index)
+    {
+        Job* job = _jobs[index];
+        Job* last = _jobs.back();
+        _jobs.pop_back();
+        if (index < _jobs.size())
+        {
+            HeapSet(index, last);
+            HeapFix(index);
+        }
+        job->index = npos;
+    }
+    // Once a window closed, gather every job whose window is open at [now]
+    // into _batch. Only heap nodes with deadline <= now + _max_slack can
+    // have next_time <= now, so the walk stops there.
+    bool CollectDue(std::chrono::steady_clock::time_point now)
+    {
+        _batch.clear();
+        if (_jobs.empty() || _jobs.front()->deadline > now)
+            return false;
+        auto limit = now + _max_slack;
+        _scan.clear();
+        _scan.push_back(0);
+        while (!_scan.empty())
+        {
+            std::size_t index = _scan.back();
+            _scan.pop_back();
+            Job* job = _jobs[index];
+            if (job->deadline > limit)
+                continue;
+            if (job->next_time <= now)
+                _batch.push_back(job);
+            if (index * 2 + 1 < _jobs.size())
+                _scan.push_back(index * 2 + 1);
+            if (index * 2 + 2 < _jobs.size())
+                _scan.push_back(index * 2 + 2);
+        }
+        return true;
+    }
     void Observe()
     {
         //printf("MinHeapTimer Observe begin\n");
         using namespace std::chrono;
-        Job* topjob = nullptr;
+        Command cmds[64];
         while (!_destructed)
         {
-            _jobs_lock.lock();
-            while (!_jobs.empty())
+            ++_pass_begin;
+            _pending.exchange(0, std::memory_order_acq_rel);
+            std::size_t count;
+            while ((count = _commands.try_dequeue_bulk(cmds, 64)) != 0)
             {
-                if (_jobs.top()->next_time <= high_resolution_clock::now())
+                for (std::size_t i = 0; i < count; ++i)
+                    Apply(cmds[i]);
+            }
+            HeapFlush();
+            auto now = _clock->Now();
+            while (CollectDue(now))
+            {
+                _fire.clear();
+                bool metrics = _metrics_on.load(std::memory_order_relaxed);
+                for (Job* job : _batch)
                 {
-                    topjob = _jobs.top();
-                    _jobs.pop();
-                    switch (topjob->flag)
-                    {
-                    case Flag::forever:
+                    TimePoint due = job->next_time;
+                    Plan(job, now);
+                    if (!job->firing)
+                        continue;
+                    _fire.push_back(job);
+                    if (metrics)
+                        _metrics->lateness.Record(static_cast<std::uint64_t>(
+                            duration_cast<microseconds>(now - due).count()));
+                }
+                RunInline();
+                Post(_fire.data(), _fire.size());
+                for (Job* job : _batch)
+                {
+                    switch (job->step)
                     {
-                        topjob->next_time += topjob->interval;
-                        _work_queue.enqueue(topjob->handle);
-                        _jobs.push(topjob);
+                    case Step::reschedule:
+                        job->deadline = job->next_time + job->slack;
+                        HeapFix(job->index);
                         break;
-                    }
-                    case Flag::once:
-                    {
-                        _work_queue.enqueue(topjob->handle);
-                        zonciu::SpinGuard idlck(_id_lock);
-                        _jobs_id.erase(topjob->id);
-                        delete topjob;
+                    case Step::finish:
+                        HeapErase(job->index);
+                        Release(job);
                         break;
-                    }
-                    case Flag::stop:
+                    case Step::detach:
                     default:
-                    {
-                        zonciu::SpinGuard idlck(_id_lock);
-                        _jobs_id.erase(topjob->id);
-                        delete topjob;
+                        HeapErase(job->index);
                         break;
                     }
-                    }
                 }
+            }
+            std::int64_t deadline = _jobs.empty() ? kNoDeadline
+                : _jobs.front()->deadline.time_since_epoch().count();
+            // publish the deadline before the last look at the queue,
+            // a racing Submit either sees it or is seen here
+            if (_metrics_on.load(std::memory_order_relaxed))
+            {
+                _metrics->heap_size.store(_jobs.size(), std::memory_order_relaxed);
+                if (_jobs.size() > _metrics->peak_heap_size.load(std::memory_order_relaxed))
+                    _metrics->peak_heap_size.store(_jobs.size(), std::memory_order_relaxed);
+            }
+            _wake_at.store(deadline);
+            ++_pass_end;
+            if (_pending.load() == 0 && !_destructed)
+            {
+                // a virtual clock wakes us through Subscribe
+                if (deadline == kNoDeadline || _clock->IsVirtual())
+                    _waiter.WaitUntil(detail::DeadlineWaiter::TimePoint::max());
                 else
-                {
-                    _jobs_lock.unlock();
-                    auto wait_time = duration_cast<microseconds>(_jobs.top()->next_time - high_resolution_clock::now());
-                    _waiter.WaitFor((wait_time.count() > 0) ? wait_time.count() : 0);
-                }
+                    WaitDeadline(detail::DeadlineWaiter::TimePoint(microseconds(deadline)));
             }
-            _jobs_lock.unlock();
-            _waiter.Wait();
+            _wake_at.store(kAwake);
         }
         //printf("MinHeapTimer Observe end\n");
     }
-    void Worker()
+    // Sleep to [margin] before the deadline, then spin the rest if the budget allows.
+    // Returning early is always fine, the next pass just waits again.
+    void WaitDeadline(detail::DeadlineWaiter::TimePoint deadline)
+    {
+        using namespace std::chrono;
+        std::int64_t budget = _spin_budget.load(std::memory_order_relaxed);
+        if (!budget)
+        {
+            _waiter.WaitUntil(deadline);
+            return;
+        }
+        std::int64_t margin = _spin_margin.load(std::memory_order_relaxed);
+        if (!margin)
+            margin = CalibratedMargin();
+        auto now = steady_clock::now();
+        auto target = deadline - microseconds(margin);
+        if (now < target)
+        {
+            _waiter.WaitUntil(target);
+            auto woke = steady_clock::now();
+            if (woke < target)
+                return;
+            // oversleep of a timer wakeup, moving average with weight 1/8
+            std::int64_t late = duration_cast<microseconds>(woke - target).count();
+            _oversleep += (late - _oversleep) / 8;
+            now = woke;
+        }
+        if (now >= deadline)
+            return;
+        // spin budget is per second of wall time
+        if (now - _spin_window >= seconds(1))
+        {
+            _spin_window = now;
+            _spin_used = 0;
+        }
+        if (_spin_used + duration_cast<microseconds>(deadline - now).count() > budget)
+        {
+            _waiter.WaitUntil(deadline);
+            return;
+        }
+        while (_pending.load(std::memory_order_relaxed) == 0 && !_destructed.load(std::memory_order_relaxed))
+        {
+            zonciu::CpuRelax();
+            if (steady_clock::now() >= deadline)
+                break;
+        }
+        _spin_used += duration_cast<microseconds>(steady_clock::now() - now).count();
+    }
+    std::int64_t CalibratedMargin() const
+    {
+        std::int64_t margin = _oversleep * 2 + kMinMargin;
+        return margin < kMaxMargin ? margin : kMaxMargin;
+    }
+    // Decide whether a due job runs now and where it goes next
+    void Plan(Job* job, std::chrono::steady_clock::time_point now)
+    {
+        using namespace std::chrono;
+        if (job->flag == Flag::once)
+        {
+            // fires only if Remove did not claim it first,
+            // a cancelled job keeps its heap ref until the remove command
+            job->firing = (ClaimSlot(job->id) != nullptr);
+            job->step = job->firing ? Step::finish : Step::detach;
+            return;
+        }
+        if (!IsLive(job->id))
+        {
+            job->firing = false;
+            job->step = Step::detach;
+            return;
+        }
+        if (job->policy.mode == IntervalMode::fixed_delay)
+        {
+            // out of the heap until the worker re-arms it
+            job->firing = true;
+            job->step = Step::detach;
+            return;
+        }
+        job->step = Step::reschedule;
+        job->firing = !(job->policy.no_overlap && job->refs.load(std::memory_order_acquire) > 1);
+        std::uint64_t interval = job->interval.count();
+        std::uint64_t late = static_cast<std::uint64_t>(duration_cast<microseconds>(now - job->next_time).count());
+        // intervals due by now, at least one
+        std::uint64_t due = interval ? late / interval + 1 : 1;
+        switch (job->policy.overrun)
+        {
+        case Overrun::fire_all:
+            due = 1;
+            break;
+        case Overrun::skip:
+            if (due > 1)
+                job->firing = false;
+            break;
+        case Overrun::coalesce:
+        default:
+            break;
+        }
+        job->next_time += job->interval * due;
+    }
+    // Run what fits in the inline budget, leave the rest in _fire for the workers.
+    // The heap ref keeps each job alive until the end of the pass.
+    void RunInline()
+    {
+        using namespace std::chrono;
+        std::int64_t budget = _inline_budget.load(std::memory_order_relaxed);
+        if (!budget || _fire.empty())
+            return;
+        auto start = steady_clock::now();
+        auto last = start;
+        std::size_t keep = 0;
+        for (std::size_t i = 0; i < _fire.size(); ++i)
+        {
+            Job* job = _fire[i];
+            // a queued or running copy must finish first, by_id never overlaps a timer
+            if (job->slow || job->refs.load(std::memory_order_acquire) > 1
+                || duration_cast<microseconds>(last - start).count() >= budget)
+            {
+                _fire[keep++] = job;
+                continue;
+            }
+            job->handle();
+            Rearm(job);
+            auto end = steady_clock::now();
+            if (duration_cast<microseconds>(end - last).count() > budget)
+                job->slow = true;
+            if (_metrics_on.load(std::memory_order_relaxed))
+                _metrics->callback_time.Record(static_cast<std::uint64_t>(
+                    duration_cast<nanoseconds>(end - last).count()));
+            last = end;
+            _inline_runs.fetch_add(1, std::memory_order_relaxed);
+        }
+        _fire.resize(keep);
+    }
+    // fixed_delay timers go back into the heap [interval] after a run returns
+    void Rearm(Job* job)
+    {
+        using namespace std::chrono;
+        if (job->flag != Flag::forever || job->policy.mode != IntervalMode::fixed_delay)
+            return;
+        std::int64_t next = time_point_cast<microseconds>(_clock->Now() + job->interval)
+            .time_since_epoch().count();
+        Command cmd = { Command::Op::rearm, nullptr, job->id, next };
+        Submit(cmd, next);
+    }
+    // Queue one run per job, a single shared queue takes the whole burst at once
+    void Post(Job* const* jobs, std::size_t count)
+    {
+        if (!count)
+            return;
+        for (std::size_t i = 0; i < count; ++i)
+            jobs[i]->refs.fetch_add(1, std::memory_order_relaxed);
+        if (_lanes.size() == 1)
+        {
+            _lanes[0]->queue.enqueue_bulk(jobs, count);
+            UpdateDepth(*_lanes[0], count);
+            return;
+        }
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            Lane& lane = *_lanes[static_cast<std::size_t>(jobs[i]->id & 0xffffffff) % _lanes.size()];
+            lane.queue.enqueue(jobs[i]);
+            UpdateDepth(lane, 1);
+        }
+    }
+    void UpdateDepth(Lane& lane, std::size_t count)
+    {
+        std::uint64_t depth = (lane.enqueued += count) - lane.executed.load(std::memory_order_relaxed);
+        if (depth > lane.peak.load(std::memory_order_relaxed))
+            lane.peak.store(depth, std::memory_order_relaxed);
+        if (_metrics_on.load(std::memory_order_relaxed))
+            _metrics->queue_depth.Record(depth);
+    }
+    void Worker(Lane* lane)
     {
         //printf("MinHeapTimer Worker begin\n");
-        TimerHandle handle;
+        Job* job = nullptr;
         while (!_destructed)
         {
-            _work_queue.wait_dequeue(handle);
-            handle();
+            lane->queue.wait_dequeue(job);
+            if (!job)
+                continue;
+            if (_metrics_on.load(std::memory_order_relaxed))
+            {
+                auto start = std::chrono::steady_clock::now();
+                job->handle();
+                _metrics->callback_time.Record(static_cast<std::uint64_t>(std::chrono::duration_cast<
+                    std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+            }
+            else
+            {
+                job->handle();
+            }
+            Rearm(job);
+            lane->executed.fetch_add(1, std::memory_order_release);
+            Release(job);
         }
         //printf("MinHeapTimer Worker end\n");
     }
-    zonciu::Semaphore _waiter;
-    zonciu::SpinLock _id_lock;
-    zonciu::SpinLock _jobs_lock;
-    std::atomic<TimerId> _jobs_id_count;
-    bool _destructed;
+    SteadyTimerClock _steady_clock;
+    TimerClock* _clock;
+    int _subscription;
+    detail::DeadlineWaiter _waiter;
+    std::atomic<bool> _destructed;
+    std::atomic<std::uint32_t> _pending;
+    // clock microseconds the observer sleeps until
+    std::atomic<std::int64_t> _wake_at;
+    // observer passes started/finished, for Sync
+    std::atomic<std::uint64_t> _pass_begin;
+    std::atomic<std::uint64_t> _pass_end;
+    moodycamel::ConcurrentQueue<Command> _commands;
+    std::atomic<Slot*> _slot_chunks[kSlotChunks];
+    std::atomic<std::uint32_t> _slot_count;
+    std::atomic<std::size_t> _live;
+    moodycamel::ConcurrentQueue<std::uint32_t> _free_slots;
+    // microseconds, 0 = no inline runs
+    std::atomic<std::int64_t> _inline_budget;
+    std::atomic<std::uint64_t> _inline_runs;
+    // microseconds, 0 = off / calibrated
+    std::atomic<std::int64_t> _spin_budget;
+    std::atomic<std::int64_t> _spin_margin;
+    std::atomic<bool> _metrics_on;
+    std::unique_ptr<MetricsData> _metrics;
+    // observer only
+    IntervalType _max_slack;
+    // jobs at the end of _jobs not sifted into place yet
+    std::size_t _staged;
+    std::int64_t _oversleep;
+    std::int64_t _spin_used;
+    std::chrono::steady_clock::time_point _spin_window;
     std::thread _observer;
-    std::thread _worker;
-    moodycamel::BlockingConcurrentQueue<TimerHandle> _work_queue;
-    std::map<unsigned int, Job*> _jobs_id;
-    std::priority_queue<Job*, std::vector<Job*>, Job::Comp> _jobs;
+    std::vector<std::unique_ptr<Lane>> _lanes;
+    std::vector<std::thread> _workers;
+    detail::SlabPool<Job> _pool;
+    std::vector<Job*> _jobs;
+    // observer scratch, kept to avoid allocating on every wakeup
+    std::vector<Job*> _batch;
+    std::vector<Job*> _fire;
+    std::vector<std::size_t> _scan;
 }; // class MinHeapTimer
 } // namespace zonciu
 
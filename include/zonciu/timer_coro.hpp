@@ -0,0 +1,219 @@
+/*
+* Copyright(c) 2016 Zonciu Liang.All rights reserved.
+* Use of this source code is governed by a BSD-style license that can be
+* found in the LICENSE file.
+*
+* Author:  Zonciu Liang
+* Contract: zonciu@zonciu.com
+* Description: C++20 coroutine awaitables on top of MinHeapTimer
+*/
+#ifndef ZONCIU_TIMER_CORO_HPP
+#define ZONCIU_TIMER_CORO_HPP
+#include "zonciu/timer.hpp"
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#define ZONCIU_HAS_COROUTINE 1
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+/*
+ * A suspended coroutine is only a timer job, no thread blocks per wait.
+ * The timer resumes it through an executor: a callable taking
+ * std::coroutine_handle<>. InlineExecutor resumes on the timer's worker
+ * (or observer, with an inline budget), so hand long work to your own
+ * executor.
+ * api:
+ * | sleep_for    - co_await sleep_for(5ms)
+ * | with_timeout - co_await with_timeout(awaitable, 1s), empty optional
+ * |                (false for void) on timeout
+ * | CoroTimer    - timer used when none is given
+*/
+namespace zonciu
+{
+struct InlineExecutor
+{
+    void operator()(std::coroutine_handle<> handle) const { handle.resume(); }
+};
+//Shared timer for the overloads without a timer argument, created on first use
+inline MinHeapTimer& CoroTimer()
+{
+    static MinHeapTimer timer;
+    return timer;
+}
+namespace detail
+{
+// Fire-and-forget coroutine, frees itself when done
+struct DetachedTask
+{
+    struct promise_type
+    {
+        DetachedTask get_return_object() noexcept { return DetachedTask(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+template<class A>
+auto GetAwaiter(A&& awaitable, int) -> decltype(std::forward<A>(awaitable).operator co_await())
+{
+    return std::forward<A>(awaitable).operator co_await();
+}
+template<class A>
+auto GetAwaiter(A&& awaitable, long) -> decltype(operator co_await(std::forward<A>(awaitable)))
+{
+    return operator co_await(std::forward<A>(awaitable));
+}
+template<class A>
+A&& GetAwaiter(A&& awaitable, ...)
+{
+    return std::forward<A>(awaitable);
+}
+template<class A>
+using AwaitResult = decltype(GetAwaiter(std::declval<A>(), 0).await_resume());
+template<class T>
+struct TimeoutState
+{
+    TimeoutState(MinHeapTimer* _timer) : timer(_timer), id(0), done(false) {}
+    // first of (awaitable, timer) to get here resumes the waiter
+    bool Win() { return !done.exchange(true, std::memory_order_acq_rel); }
+    MinHeapTimer* timer;
+    MinHeapTimer::TimerId id;
+    std::atomic<bool> done;
+    std::coroutine_handle<> waiter;
+    std::exception_ptr error;
+    std::optional<typename std::conditional<std::is_void<T>::value, bool, T>::type> value;
+};
+template<class T, class A, class Executor>
+DetachedTask RunTimeout(std::shared_ptr<TimeoutState<T>> state, A awaitable, Executor executor)
+{
+    // kept local until we win, a timed-out waiter may be reading state
+    std::optional<typename std::conditional<std::is_void<T>::value, bool, T>::type> value;
+    std::exception_ptr error;
+    try
+    {
+        if constexpr (std::is_void<T>::value)
+        {
+            co_await std::move(awaitable);
+            value.emplace(true);
+        }
+        else
+        {
+            value.emplace(co_await std::move(awaitable));
+        }
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+    if (state->Win())
+    {
+        state->value = std::move(value);
+        state->error = std::move(error);
+        state->timer->Remove(state->id);
+        executor(state->waiter);
+    }
+}
+} // namespace detail
+
+template<class Executor = InlineExecutor>
+class SleepAwaiter
+{
+public:
+    SleepAwaiter(MinHeapTimer& timer, std::chrono::microseconds delay, Executor executor)
+        :
+        _timer(&timer), _delay(delay), _executor(std::move(executor))
+    {}
+    bool await_ready() const noexcept { return _delay.count() <= 0; }
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        // the coroutine may resume on another thread before this returns
+        Executor executor = _executor;
+        _timer->SetTimeout(_delay, [handle, executor]() mutable { executor(handle); });
+    }
+    void await_resume() const noexcept {}
+private:
+    MinHeapTimer* _timer;
+    std::chrono::microseconds _delay;
+    Executor _executor;
+};
+
+template<class T, class A, class Executor = InlineExecutor>
+class TimeoutAwaiter
+{
+    typedef detail::TimeoutState<T> State;
+public:
+    typedef typename std::conditional<std::is_void<T>::value, bool, std::optional<T>>::type ResultType;
+    TimeoutAwaiter(MinHeapTimer& timer, A awaitable, std::chrono::microseconds timeout, Executor executor)
+        :
+        _awaitable(std::move(awaitable)), _timeout(timeout), _executor(std::move(executor)),
+        _state(std::make_shared<State>(&timer))
+    {}
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        // nothing below may touch *this once the timer or the awaitable can resume us
+        std::shared_ptr<State> state = _state;
+        Executor executor = _executor;
+        A awaitable = std::move(_awaitable);
+        state->waiter = handle;
+        // timer first, so the awaitable always has an id to remove
+        state->id = state->timer->SetTimeout(_timeout, [state, executor]() mutable
+        {
+            if (state->Win())
+                executor(state->waiter);
+        });
+        detail::RunTimeout<T>(std::move(state), std::move(awaitable), std::move(executor));
+    }
+    ResultType await_resume()
+    {
+        if (_state->error)
+            std::rethrow_exception(_state->error);
+        if constexpr (std::is_void<T>::value)
+            return _state->value.has_value();
+        else
+            return std::move(_state->value);
+    }
+private:
+    A _awaitable;
+    std::chrono::microseconds _timeout;
+    Executor _executor;
+    std::shared_ptr<State> _state;
+};
+
+//co_await sleep_for(5ms), resumes through [executor]
+template<class _Rep, class _Period, class Executor = InlineExecutor>
+SleepAwaiter<Executor> sleep_for(MinHeapTimer& timer, std::chrono::duration<_Rep, _Period> delay,
+    Executor executor = Executor())
+{
+    return SleepAwaiter<Executor>(timer, std::chrono::ceil<std::chrono::microseconds>(delay), std::move(executor));
+}
+template<class _Rep, class _Period>
+SleepAwaiter<InlineExecutor> sleep_for(std::chrono::duration<_Rep, _Period> delay)
+{
+    return sleep_for(CoroTimer(), delay);
+}
+//co_await with_timeout(awaitable, 1s)
+//The awaitable keeps running after a timeout, its result is dropped.
+//Return std::optional<T>, or bool for void awaitables; empty/false = timed out
+template<class A, class _Rep, class _Period, class Executor = InlineExecutor>
+TimeoutAwaiter<detail::AwaitResult<A>, typename std::decay<A>::type, Executor>
+with_timeout(MinHeapTimer& timer, A&& awaitable, std::chrono::duration<_Rep, _Period> timeout,
+    Executor executor = Executor())
+{
+    return TimeoutAwaiter<detail::AwaitResult<A>, typename std::decay<A>::type, Executor>(timer,
+        std::forward<A>(awaitable), std::chrono::ceil<std::chrono::microseconds>(timeout), std::move(executor));
+}
+template<class A, class _Rep, class _Period>
+TimeoutAwaiter<detail::AwaitResult<A>, typename std::decay<A>::type>
+with_timeout(A&& awaitable, std::chrono::duration<_Rep, _Period> timeout)
+{
+    return with_timeout(CoroTimer(), std::forward<A>(awaitable), timeout);
+}
+} // namespace zonciu
+#endif // __cpp_impl_coroutine
+#endif // ZONCIU_TIMER_CORO_HPP
@@ -0,0 +1,369 @@
+/*
+* Copyright(c) 2016 Zonciu Liang.All rights reserved.
+* Use of this source code is governed by a BSD-style license that can be
+* found in the LICENSE file.
+*
+* Author:  Zonciu Liang
+* Contract: zonciu@zonciu.com
+* Description: hierarchical timing wheel timer
+*/
+
+#ifndef ZONCIU_WHEEL_TIMER_HPP
+#define ZONCIU_WHEEL_TIMER_HPP
+
+#include "zonciu/3rd/concurrentqueue/blockingconcurrentqueue.h"
+#include "zonciu/lock.hpp"
+#include "zonciu/semaphor.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <unordered_map>
+namespace zonciu
+{
+/*
+ * Hierarchical timing wheel timer, same api as MinHeapTimer.
+ * Insert, remove and expiry are O(1), precision is one tick.
+ * Wheel layout: 256 slots on level 0, 64 slots on levels 1-4,
+ * which covers 2^32 ticks; longer timers are cascaded again.
+ * api:
+ * | SetInterval - return timer_id
+ * | SetTimeout  - return timer_id
+ * | Remove
+ * | Clear
+*/
+class WheelTimer
+{
+public:
+    typedef std::function<void()> TimerHandle;
+    typedef int TimerId;
+    typedef std::chrono::microseconds TickType;
+private:
+    enum
+    {
+        kRootBits = 8,
+        kLevelBits = 6,
+        kRootSize = 1 << kRootBits,
+        kLevelSize = 1 << kLevelBits,
+        kRootMask = kRootSize - 1,
+        kLevelMask = kLevelSize - 1,
+        kLevels = 4
+    };
+    struct Node
+    {
+        Node() : prev(this), next(this) {}
+        void Unlink()
+        {
+            prev->next = next;
+            next->prev = prev;
+            prev = next = this;
+        }
+        void InsertBefore(Node* pos)
+        {
+            prev = pos->prev;
+            next = pos;
+            pos->prev->next = this;
+            pos->prev = this;
+        }
+        bool Empty() const { return next == this; }
+        Node* prev;
+        Node* next;
+    };
+    struct Job : Node
+    {
+        Job(TimerId _id, std::uint64_t _interval, TimerHandle _handle)
+            :
+            id(_id), interval(_interval), handle(_handle), expire(0), root(false)
+        {}
+        const TimerId id;
+        // ticks, 0 = run once
+        const std::uint64_t interval;
+        const TimerHandle handle;
+        std::uint64_t expire;
+        bool root;
+    };
+public:
+    // tick: wheel resolution, smaller tick = more precise, more wakeups
+    template<class _Rep = long long, class _Period = std::milli>
+    explicit WheelTimer(std::chrono::duration<_Rep, _Period> tick = std::chrono::milliseconds(1))
+        :
+        _tick(std::chrono::duration_cast<TickType>(tick)),
+        _start(std::chrono::steady_clock::now()),
+        _current(0), _root_count(0), _jobs_id_count(0), _destructed(false)
+    {
+        if (_tick.count() <= 0)
+            _tick = TickType(1);
+        _observer = std::thread(&WheelTimer::Observe, this);
+        _worker = std::thread(&WheelTimer::Worker, this);
+    }
+    ~WheelTimer()
+    {
+        _destructed = true;
+        _waiter.Signal();
+        _work_queue.enqueue([]() {});
+        _observer.join();
+        _worker.join();
+        Clear();
+    }
+    //Wait and run
+    //Return timer_id
+    TimerId SetInterval(std::uint32_t interval_milli, TimerHandle func)
+    {
+        return Add(std::chrono::milliseconds(interval_milli), true, func);
+    }
+    template<class _Rep, class _Period>
+    TimerId SetInterval(std::chrono::duration<_Rep, _Period> interval, TimerHandle func)
+    {
+        return Add(interval, true, func);
+    }
+    //Wait and run once
+    //Return timer_id
+    TimerId SetTimeout(std::uint32_t interval_milli, TimerHandle func)
+    {
+        return Add(std::chrono::milliseconds(interval_milli), false, func);
+    }
+    template<class _Rep, class _Period>
+    TimerId SetTimeout(std::chrono::duration<_Rep, _Period> interval, TimerHandle func)
+    {
+        return Add(interval, false, func);
+    }
+    //Return false if timer not found
+    bool Remove(TimerId timer_id)
+    {
+        zonciu::SpinGuard lck(_lock);
+        auto it = _jobs_id.find(timer_id);
+        if (it == _jobs_id.end())
+            return false;
+        Detach(it->second);
+        delete it->second;
+        _jobs_id.erase(it);
+        return true;
+    }
+    void Clear()
+    {
+        zonciu::SpinGuard lck(_lock);
+        for (auto& it : _jobs_id)
+        {
+            Detach(it.second);
+            delete it.second;
+        }
+        _jobs_id.clear();
+    }
+    size_t Size()
+    {
+        zonciu::SpinGuard lck(_lock);
+        return _jobs_id.size();
+    }
+    TickType Tick() const { return _tick; }
+private:
+    template<class _Rep, class _Period>
+    TimerId Add(std::chrono::duration<_Rep, _Period> interval, bool forever, TimerHandle& func)
+    {
+        using namespace std::chrono;
+        // round up, a timer never fires before its interval
+        auto us = duration_cast<TickType>(interval);
+        if (us < interval)
+            ++us;
+        std::uint64_t ticks = us.count() > 0 ? (us.count() + _tick.count() - 1) / _tick.count() : 0;
+        if (ticks == 0)
+            ticks = 1;
+        TimerId ret_id = _jobs_id_count++;
+        auto* tmp = new Job(ret_id, forever ? ticks : 0, func);
+        // now + interval may fall inside a tick, fire at the next tick boundary
+        tmp->expire = static_cast<std::uint64_t>(
+            (duration_cast<TickType>(steady_clock::now() - _start) + us).count() + _tick.count() - 1) / _tick.count();
+        zonciu::SpinGuard lck(_lock);
+        bool was_empty = _jobs_id.empty();
+        if (was_empty)
+        {
+            // observer may sleep for a long time while empty, skip the stale ticks
+            std::uint64_t now_tick = NowTick();
+            if (now_tick > _current)
+                _current = now_tick;
+        }
+        _jobs_id.insert(std::make_pair(ret_id, tmp));
+        Place(tmp);
+        // observer sleeps until the next cascade point while level 0 is empty
+        if (was_empty || (tmp->root && _root_count == 1))
+            _waiter.Signal();
+        return ret_id;
+    }
+    std::uint64_t NowTick() const
+    {
+        using namespace std::chrono;
+        return static_cast<std::uint64_t>(
+            duration_cast<TickType>(steady_clock::now() - _start).count() / _tick.count());
+    }
+    // Put job into the slot matching its distance from _current
+    void Place(Job* job)
+    {
+        std::uint64_t expire = job->expire;
+        if (expire < _current)
+            expire = _current;
+        std::uint64_t idx = expire - _current;
+        Node* slot = nullptr;
+        job->root = false;
+        if (idx < kRootSize)
+        {
+            slot = &_root[expire & kRootMask];
+            job->root = true;
+            ++_root_count;
+        }
+        else
+        {
+            int level = 0;
+            while (level < kLevels - 1 && idx >= (1ULL << (kRootBits + (level + 1) * kLevelBits)))
+                ++level;
+            if (level == kLevels - 1 && idx > 0xffffffffULL)
+            {
+                // out of range, park on the top level and cascade again later
+                expire = _current + 0xffffffffULL;
+            }
+            slot = &_levels[level][(expire >> (kRootBits + level * kLevelBits)) & kLevelMask];
+        }
+        job->InsertBefore(slot);
+    }
+    void Detach(Job* job)
+    {
+        if (job->root)
+        {
+            --_root_count;
+            job->root = false;
+        }
+        job->Unlink();
+    }
+    // Move every job of _levels[level][index] to a lower level, return index
+    int Cascade(int level, int index)
+    {
+        Node list;
+        Node* slot = &_levels[level][index];
+        if (!slot->Empty())
+        {
+            list.next = slot->next;
+            list.prev = slot->prev;
+            list.next->prev = &list;
+            list.prev->next = &list;
+            slot->prev = slot->next = slot;
+        }
+        while (!list.Empty())
+        {
+            Job* job = static_cast<Job*>(list.next);
+            job->Unlink();
+            Place(job);
+        }
+        return index;
+    }
+    // Process tick _current, caller holds _lock
+    void Step()
+    {
+        int index = static_cast<int>(_current & kRootMask);
+        if (!index)
+        {
+            int level = 0;
+            while (level < kLevels
+                && !Cascade(level, static_cast<int>((_current >> (kRootBits + level * kLevelBits)) & kLevelMask)))
+                ++level;
+        }
+        Node list;
+        Node* slot = &_root[index];
+        if (!slot->Empty())
+        {
+            list.next = slot->next;
+            list.prev = slot->prev;
+            list.next->prev = &list;
+            list.prev->next = &list;
+            slot->prev = slot->next = slot;
+        }
+        // jobs re-placed below must not land in the slot being processed
+        ++_current;
+        while (!list.Empty())
+        {
+            Job* job = static_cast<Job*>(list.next);
+            job->Unlink();
+            --_root_count;
+            job->root = false;
+            _work_queue.enqueue(job->handle);
+            if (job->interval)
+            {
+                job->expire += job->interval;
+                Place(job);
+            }
+            else
+            {
+                _jobs_id.erase(job->id);
+                delete job;
+            }
+        }
+    }
+    void Observe()
+    {
+        using namespace std::chrono;
+        while (!_destructed)
+        {
+            long long wait_us = -1;
+            {
+                zonciu::SpinGuard lck(_lock);
+                std::uint64_t now_tick = NowTick();
+                if (_jobs_id.empty())
+                {
+                    if (now_tick > _current)
+                        _current = now_tick;
+                }
+                else
+                {
+                    while (_current <= now_tick)
+                    {
+                        // nothing on level 0, jump to the next cascade point
+                        if (!_root_count && (_current & kRootMask))
+                        {
+                            std::uint64_t next = (_current | kRootMask) + 1;
+                            _current = next <= now_tick ? next : now_tick + 1;
+                            continue;
+                        }
+                        Step();
+                    }
+                    // _current may itself be the next cascade point, it is not processed yet
+                    std::uint64_t next_tick = _root_count || !(_current & kRootMask)
+                        ? _current : ((_current | kRootMask) + 1);
+                    auto deadline = _start + TickType(next_tick * _tick.count());
+                    wait_us = duration_cast<microseconds>(deadline - steady_clock::now()).count();
+                    if (wait_us < 0)
+                        wait_us = 0;
+                }
+            }
+            if (wait_us < 0)
+                _waiter.Wait();
+            else if (wait_us > 0)
+                _waiter.WaitFor(static_cast<unsigned long long>(wait_us));
+        }
+    }
+    void Worker()
+    {
+        TimerHandle handle;
+        while (!_destructed)
+        {
+            _work_queue.wait_dequeue(handle);
+            handle();
+        }
+    }
+    WheelTimer(const WheelTimer&) = delete;
+    const WheelTimer& operator=(const WheelTimer&) = delete;
+    TickType _tick;
+    const std::chrono::steady_clock::time_point _start;
+    std::uint64_t _current;
+    std::uint64_t _root_count;
+    Node _root[kRootSize];
+    Node _levels[kLevels][kLevelSize];
+    zonciu::Semaphore _waiter;
+    zonciu::SpinLock _lock;
+    std::atomic<TimerId> _jobs_id_count;
+    std::atomic<bool> _destructed;
+    std::thread _observer;
+    std::thread _worker;
+    moodycamel::BlockingConcurrentQueue<TimerHandle> _work_queue;
+    std::unordered_map<TimerId, Job*> _jobs_id;
+}; // class WheelTimer
+} // namespace zonciu
+
+#endif // ZONCIU_WHEEL_TIMER_HPP
@@ -0,0 +1,83 @@
+/*
+* Copyright(c) 2016 Zonciu Liang.All rights reserved.
+* Use of this source code is governed by a BSD-style license that can be
+* found in the LICENSE file.
+*
+* Author:  Zonciu Liang
+* Contract: zonciu@zonciu.com
+* Description: fiber fairness, a yield loop or a semaphore ping-pong on one
+*              worker must not starve another ready fiber
+*
+* Build: g++ -std=c++11 -O2 -I../include fiber_yield_test.cpp -o fiber_yield_test -pthread
+* Exit code 0 on success
+*/
+#include "zonciu/fiber.hpp"
+#include <atomic>
+#include <cstdio>
+namespace
+{
+const int kLimit = 100000;
+// a spins on Yield until b ran; both are spawned on the worker, b first,
+// so a runs first and b sits under it in the worker's deque
+bool YieldLoop()
+{
+    zonciu::FiberScheduler scheduler(1);
+    std::atomic<bool> b_ran(false);
+    std::atomic<int> a_spins(0);
+    scheduler.Spawn([&]()
+    {
+        scheduler.Spawn([&]() { b_ran.store(true); });
+        scheduler.Spawn([&]()
+        {
+            while (!b_ran.load() && a_spins.load() < kLimit)
+            {
+                a_spins.fetch_add(1);
+                zonciu::this_fiber::Yield();
+            }
+        });
+    });
+    scheduler.Join();
+    std::printf("yield loop: b_ran=%d a_spins=%d\n", b_ran.load() ? 1 : 0, a_spins.load());
+    return b_ran.load() && a_spins.load() < kLimit;
+}
+// two fibers hand a semaphore back and forth, a third one waits its turn
+bool PingPong()
+{
+    zonciu::FiberScheduler scheduler(1);
+    zonciu::FiberSemaphore ping;
+    zonciu::FiberSemaphore pong;
+    std::atomic<bool> c_ran(false);
+    std::atomic<int> rounds(0);
+    scheduler.Spawn([&]()
+    {
+        while (!c_ran.load() && rounds.load() < kLimit)
+        {
+            rounds.fetch_add(1);
+            pong.Signal();
+            ping.Wait();
+        }
+        pong.Signal();
+    });
+    scheduler.Spawn([&]()
+    {
+        while (!c_ran.load() && rounds.load() < kLimit)
+        {
+            pong.Wait();
+            ping.Signal();
+        }
+        ping.Signal();
+    });
+    scheduler.Spawn([&]() { c_ran.store(true); });
+    scheduler.Join();
+    std::printf("ping-pong: c_ran=%d rounds=%d\n", c_ran.load() ? 1 : 0, rounds.load());
+    return c_ran.load() && rounds.load() < kLimit;
+}
+} // namespace
+
+int main()
+{
+    bool ok = YieldLoop();
+    ok = PingPong() && ok;
+    std::printf("%s\n", ok ? "passed" : "FAILED");
+    return ok ? 0 : 1;
+}